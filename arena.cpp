@@ -0,0 +1,94 @@
+#include <algorithm>
+#include <cstdint>
+#include <new>
+
+#include "arena.hpp"
+
+namespace microhal {
+    namespace {
+        char* block_data(void* block, std::size_t header) {
+            return static_cast<char*>(block) + header;
+        }
+
+        thread_local std::size_t scratch_depth = 0;
+    }
+
+    // ARENA
+    Arena::Arena(std::size_t block_size, std::size_t max_kept)
+    : m_head(nullptr), m_cursor(nullptr), m_end(nullptr), m_block_size(block_size), m_initial_block_size(block_size),
+      m_max_kept(max_kept), m_used(0) {
+    }
+
+    Arena::~Arena() {
+        release();
+    }
+
+    void Arena::release() {
+        while (m_head != nullptr) {
+            auto next = m_head->next;
+            ::operator delete(m_head);
+            m_head = next;
+        }
+        m_cursor = m_end = nullptr;
+        m_used = 0;
+    }
+
+    void Arena::grow(std::size_t bytes, std::size_t alignment) {
+        auto size = std::max(m_block_size, bytes + alignment);
+        auto block = static_cast<Block*>(::operator new(sizeof(Block) + size));
+        block->next = m_head;
+        block->size = size;
+        m_head = block;
+        m_cursor = block_data(block, sizeof(Block));
+        m_end = m_cursor + size;
+        m_used += size;
+    }
+
+    void* Arena::allocate(std::size_t bytes, std::size_t alignment) {
+        auto aligned = [&]() {
+            auto p = reinterpret_cast<std::uintptr_t>(m_cursor);
+            return reinterpret_cast<char*>((p + alignment - 1) & ~(alignment - 1));
+        };
+        if (m_cursor == nullptr || aligned() + bytes > m_end) {
+            grow(bytes, alignment);
+        }
+        auto p = aligned();
+        m_cursor = p + bytes;
+        return p;
+    }
+
+    void Arena::reset() {
+        if (m_head == nullptr) { return; }
+        if (m_head->next == nullptr && m_used <= m_max_kept) {
+            m_cursor = block_data(m_head, sizeof(Block));
+            return;
+        }
+        // The last request needed several blocks; replace them with one
+        // block covering all of them so the next request fits without growing,
+        // unless that is more than may be kept.
+        auto total = m_used;
+        release();
+        m_block_size = total <= m_max_kept ? std::max(m_block_size, total) : m_initial_block_size;
+        grow(0, 1);
+    }
+
+    std::size_t Arena::capacity() const {
+        return m_used;
+    }
+
+    Arena& scratch_arena() {
+        thread_local Arena arena;
+        return arena;
+    }
+
+    // SCRATCH SCOPE
+    ScratchScope::ScratchScope() {
+        ++scratch_depth;
+    }
+
+    ScratchScope::~ScratchScope() {
+        if (--scratch_depth == 0) {
+            scratch_arena().reset();
+        }
+    }
+}
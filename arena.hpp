@@ -0,0 +1,83 @@
+#ifndef MICROHAL_ARENA_H
+#define MICROHAL_ARENA_H
+
+#include <cstddef>
+#include <vector>
+
+namespace microhal {
+
+    // Monotonic buffer for request temporaries. Memory is only released by
+    // reset(), which keeps a single block large enough for the next request,
+    // up to max_kept bytes. Past that the arena drops back to block_size, so
+    // one huge request does not pin its memory for the life of the thread.
+    class Arena {
+        struct Block {
+            Block*      next;
+            std::size_t size;
+        };
+
+        Block*      m_head;
+        char*       m_cursor;
+        char*       m_end;
+        std::size_t m_block_size;
+        std::size_t m_initial_block_size;
+        std::size_t m_max_kept;
+        std::size_t m_used;
+
+        void grow(std::size_t bytes, std::size_t alignment);
+        void release();
+
+    public:
+        explicit Arena(std::size_t block_size = 16 * 1024, std::size_t max_kept = 1024 * 1024);
+        ~Arena();
+        Arena(const Arena&) = delete;
+        Arena& operator=(const Arena&) = delete;
+
+        void* allocate(std::size_t bytes, std::size_t alignment);
+        void reset();
+        std::size_t capacity() const;
+    };
+
+    // The arena belonging to the calling thread.
+    Arena& scratch_arena();
+
+    // Resets the thread's arena when the outermost scope on that thread ends,
+    // so nested calls can share temporaries with their caller.
+    class ScratchScope {
+    public:
+        ScratchScope();
+        ~ScratchScope();
+        ScratchScope(const ScratchScope&) = delete;
+        ScratchScope& operator=(const ScratchScope&) = delete;
+    };
+
+    template<typename T>
+    class ScratchAllocator {
+        Arena* m_arena;
+
+        template<typename U> friend class ScratchAllocator;
+
+    public:
+        using value_type = T;
+
+        ScratchAllocator() : m_arena(&scratch_arena()) {}
+        explicit ScratchAllocator(Arena& arena) : m_arena(&arena) {}
+        template<typename U>
+        ScratchAllocator(const ScratchAllocator<U>& other) : m_arena(other.m_arena) {}
+
+        T* allocate(std::size_t n) {
+            return static_cast<T*>(m_arena->allocate(n * sizeof(T), alignof(T)));
+        }
+        void deallocate(T*, std::size_t) {}
+
+        template<typename U>
+        bool operator==(const ScratchAllocator<U>& other) const { return m_arena == other.m_arena; }
+        template<typename U>
+        bool operator!=(const ScratchAllocator<U>& other) const { return m_arena != other.m_arena; }
+    };
+
+    template<typename T>
+    using ScratchVector = std::vector<T, ScratchAllocator<T>>;
+}
+
+#endif
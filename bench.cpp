@@ -0,0 +1,759 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <linux/perf_event.h>
+#include <malloc.h>
+#include <map>
+#include <new>
+#include <random>
+#include <shared_mutex>
+#include <sstream>
+#include <string>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "corpus.hpp"
+#include "frozen.hpp"
+#include "learner.hpp"
+#include "microhal.hpp"
+#include "mphf.hpp"
+#include "pool.hpp"
+#include "report.hpp"
+#include "search.hpp"
+
+// Live heap bytes, used to report the footprint of the brains, and the
+// allocations made so far, reported per operation for every case.
+static std::atomic<std::size_t> live_bytes(0);
+static std::atomic<std::size_t> allocations(0);
+static std::atomic<std::size_t> allocated_bytes(0);
+
+void* operator new(std::size_t n) {
+    auto p = std::malloc(n == 0 ? 1 : n);
+    if (p == nullptr) { throw std::bad_alloc(); }
+    auto size = malloc_usable_size(p);
+    live_bytes.fetch_add(size, std::memory_order_relaxed);
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    if (p == nullptr) { return; }
+    live_bytes.fetch_sub(malloc_usable_size(p), std::memory_order_relaxed);
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+    operator delete(p);
+}
+
+namespace microhal {
+    // Reaches the private stages of Microhal::add so they can be timed alone.
+    struct BenchmarkAccess {
+        static std::size_t best_prefixes(const Microhal& m, const std::string& input) {
+            ScratchScope scope;
+            ScratchVector<TokenRef> tokens;
+            tokenize(input, tokens);
+            return m.get_best_prefixes(tokens).size();
+        }
+
+        static std::vector<Prefix> prefixes(const Microhal& m, std::size_t n) {
+            std::vector<Prefix> out;
+            for (auto& p : m.m_prefixes) {
+                if (out.size() == n) { break; }
+                out.push_back(p.first);
+            }
+            return out;
+        }
+
+        static std::string build_response(const Microhal& m, const Prefix& p) {
+            ScratchScope scope;
+            return m.build_response(p);
+        }
+
+        // Suffixes leading to a prefix the brain does not hold.
+        static std::size_t dangling(const Microhal& m) {
+            ScratchScope scope;
+            auto order = static_cast<std::size_t>(m.m_order);
+            ScratchVector<TokenRef> key(order + 1);
+            std::size_t found = 0;
+            auto check = [&](const SuffixMap& sm, const TokenRef* first) {
+                for (auto s : sm) {
+                    if (s.first.empty()) { continue; }
+                    key[first == key.data() ? 0 : order] = s.first;
+                    if (m.m_prefixes.find(PrefixRef(first, first + order, m.m_order)) == m.m_prefixes.end()) { ++found; }
+                }
+            };
+            for (auto& p : m.m_prefixes) {
+                std::copy(p.first.begin(), p.first.end(), key.begin() + 1);
+                check(p.second.first, key.data());
+                std::copy(p.first.begin(), p.first.end(), key.begin());
+                check(p.second.second, key.data() + 1);
+            }
+            return found;
+        }
+    };
+}
+
+namespace {
+    using microhal::BenchmarkAccess;
+
+    struct Options {
+        std::size_t lines = 10000;
+        std::size_t ngrams = 0;
+        int         order = 4;
+        std::size_t vocabulary = 5000;
+        double      zipf = 1.0;
+        double      median_words = 10.0;
+        std::size_t dump_corpus = 0;
+        // perfect hash keys; 10000000 or more for tables that miss cache
+        std::size_t hash_keys = 1000000;
+        double      min_time = 0.2;
+        // doubling batches to run at least, the last of which is measured
+        std::size_t min_rounds = 1;
+        std::string format = "json";
+        std::string filter;
+        unsigned    seed = 42;
+        bool        counters = true;
+        // run only the cases with a budget, and fail if one is left out
+        bool        budgets_only = false;
+        // fail when a brain learned with eviction or decay holds suffixes
+        // leading to prefixes it has dropped
+        bool        check_links = false;
+        // most allocations per operation a case may make before the run
+        // fails, so allocation regressions break `make test`
+        std::map<std::string, double> budgets = {
+            {"tokenize", 0},
+            {"suffixmap_get", 0},
+            {"get_best_prefixes", 0},
+            {"build_response", 1},
+            {"microhal_reply", 1},
+            {"microhal_learn", 64},
+            {"json_load/allocs_per_prefix", 64},
+            {"frozen_reply", 1},
+            {"mphf_lookup", 0}
+        };
+    };
+
+    struct Result {
+        std::string                   name;
+        std::size_t                   iterations;
+        double                        seconds;
+        std::map<std::string, double> metrics;
+    };
+
+    // Hardware counters of the calling thread, counted in user space only.
+    // Counters the kernel refuses, as is common in containers or with a
+    // strict perf_event_paranoid, are left out of the results.
+    class PerfCounters {
+        struct Counter {
+            const char* name;
+            int         fd;
+        };
+
+        std::vector<Counter> m_counters;
+
+        void open(const char* name, std::uint32_t type, std::uint64_t config) {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = type;
+            attr.config = config;
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            auto fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+            if (fd < 0) {
+                std::cerr << "counter " << name << " unavailable: " << std::strerror(errno) << std::endl;
+                return;
+            }
+            m_counters.push_back(Counter{name, fd});
+        }
+
+        static std::uint64_t cache_miss(std::uint64_t cache) {
+            return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        }
+
+    public:
+        explicit PerfCounters(bool enabled) {
+            if (!enabled) { return; }
+            open("cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+            open("instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+            open("branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+            open("l1d_misses", PERF_TYPE_HW_CACHE, cache_miss(PERF_COUNT_HW_CACHE_L1D));
+            open("llc_misses", PERF_TYPE_HW_CACHE, cache_miss(PERF_COUNT_HW_CACHE_LL));
+        }
+
+        ~PerfCounters() {
+            for (auto& c : m_counters) { close(c.fd); }
+        }
+
+        PerfCounters(const PerfCounters&) = delete;
+        PerfCounters& operator=(const PerfCounters&) = delete;
+
+        void start() {
+            for (auto& c : m_counters) {
+                ioctl(c.fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(c.fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+
+        // Stops the counters and adds their values per iteration to metrics,
+        // scaled up when the kernel multiplexed them.
+        void stop(std::size_t iterations, std::map<std::string, double>& metrics) {
+            for (auto& c : m_counters) { ioctl(c.fd, PERF_EVENT_IOC_DISABLE, 0); }
+            for (auto& c : m_counters) {
+                std::uint64_t values[3];
+                if (read(c.fd, values, sizeof(values)) != static_cast<ssize_t>(sizeof(values)) || values[2] == 0) { continue; }
+                auto scaled = static_cast<double>(values[0]) * static_cast<double>(values[1]) / static_cast<double>(values[2]);
+                metrics[c.name] = scaled / static_cast<double>(iterations);
+            }
+            auto cycles = metrics.find("cycles");
+            auto instructions = metrics.find("instructions");
+            if (cycles != metrics.end() && instructions != metrics.end() && cycles->second > 0) {
+                metrics["ipc"] = instructions->second / cycles->second;
+            }
+        }
+    };
+
+    // Threads of this process, from /proc.
+    std::size_t thread_count() {
+        std::ifstream status("/proc/self/status");
+        std::string line;
+        while (std::getline(status, line)) {
+            if (line.compare(0, 8, "Threads:") == 0) { return std::stoul(line.substr(8)); }
+        }
+        return 0;
+    }
+
+    class Suite {
+        const Options&      m_options;
+        std::vector<Result> m_results;
+        PerfCounters        m_counters;
+        bool                m_threads_ok = true;
+
+        bool budgeted(const std::string& name) const {
+            for (auto& b : m_options.budgets) {
+                if (b.first.substr(0, b.first.find('/')) == name) { return true; }
+            }
+            return false;
+        }
+
+    public:
+        explicit Suite(const Options& options) : m_options(options), m_counters(options.counters) {}
+
+        bool enabled(const std::string& name) const {
+            if (m_options.budgets_only && !budgeted(name)) { return false; }
+            return m_options.filter.empty() || name.find(m_options.filter) != std::string::npos;
+        }
+
+        // Calls f(i) with a growing batch size until the case has run for
+        // at least min_time and min_rounds batches. Allocations are counted
+        // over the last batch, so one-time warm up such as growing the
+        // scratch arena is left out. The counts are process wide, so a
+        // budgeted case must run with no other thread alive.
+        template<typename F>
+        Result* run(const std::string& name, F f) {
+            if (!enabled(name)) { return nullptr; }
+            if (budgeted(name) && thread_count() != 1) {
+                std::cerr << name << ": measured with " << thread_count() << " threads running" << std::endl;
+                m_threads_ok = false;
+            }
+            std::size_t rounds = 0;
+            std::size_t iterations = 0;
+            std::size_t batch = 1;
+            double elapsed = 0;
+            std::size_t allocs = 0;
+            std::size_t bytes = 0;
+            m_counters.start();
+            while (elapsed < m_options.min_time || rounds < std::max<std::size_t>(1, m_options.min_rounds)) {
+                allocs = allocations.load();
+                bytes = allocated_bytes.load();
+                auto start = std::chrono::steady_clock::now();
+                for (std::size_t i = 0; i < batch; ++i) { f(iterations + i); }
+                elapsed += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                allocs = allocations.load() - allocs;
+                bytes = allocated_bytes.load() - bytes;
+                iterations += batch;
+                batch *= 2;
+                ++rounds;
+            }
+            m_results.push_back(Result{name, iterations, elapsed, {}});
+            auto& metrics = m_results.back().metrics;
+            m_counters.stop(iterations, metrics);
+            metrics["allocs_per_op"] = static_cast<double>(allocs) / static_cast<double>(batch / 2);
+            metrics["alloc_bytes_per_op"] = static_cast<double>(bytes) / static_cast<double>(batch / 2);
+            std::cerr << name << ": " << elapsed * 1e9 / static_cast<double>(iterations) << " ns/op" << std::endl;
+            return &m_results.back();
+        }
+
+        // Lists the cases over their allocation budget on stderr. A budget
+        // named "case" limits allocs_per_op, and "case/metric" limits metric.
+        // With budgets_only, a budgeted case that did not run fails too.
+        bool within_budgets() const {
+            bool ok = m_threads_ok;
+            for (auto& b : m_options.budgets) {
+                auto slash = b.first.find('/');
+                auto name = b.first.substr(0, slash);
+                auto metric = slash == std::string::npos ? "allocs_per_op" : b.first.substr(slash + 1);
+                auto ran = std::any_of(m_results.begin(), m_results.end(), [&](const Result& r) { return r.name == name; });
+                if (m_options.budgets_only && !ran) {
+                    std::cerr << name << ": has a budget but did not run" << std::endl;
+                    ok = false;
+                }
+                for (auto& r : m_results) {
+                    auto value = r.metrics.find(metric);
+                    if (r.name != name || value == r.metrics.end() || value->second <= b.second) { continue; }
+                    std::cerr << r.name << ": " << metric << " is " << value->second << ", budget is " << b.second << std::endl;
+                    ok = false;
+                }
+            }
+            return ok;
+        }
+
+        void report(std::ostream& os, const std::map<std::string, json>& context) const {
+            if (m_options.format == "csv") {
+                os << "name,iterations,ns_per_op,metric,value\n";
+                for (auto& r : m_results) {
+                    auto ns = r.seconds * 1e9 / static_cast<double>(r.iterations);
+                    os << r.name << "," << r.iterations << "," << ns << ",,\n";
+                    for (auto& m : r.metrics) {
+                        os << r.name << "," << r.iterations << "," << ns << "," << m.first << "," << m.second << "\n";
+                    }
+                }
+                return;
+            }
+            json j;
+            j["context"] = context;
+            j["benchmarks"] = json::array();
+            for (auto& r : m_results) {
+                json b = {
+                    {"name", r.name},
+                    {"iterations", r.iterations},
+                    {"ns_per_op", r.seconds * 1e9 / static_cast<double>(r.iterations)}
+                };
+                for (auto& m : r.metrics) { b[m.first] = m.second; }
+                j["benchmarks"].push_back(b);
+            }
+            os << j.dump(2) << std::endl;
+        }
+    };
+
+    microhal::Corpus corpus(const Options& o, unsigned seed) {
+        microhal::CorpusOptions c;
+        c.vocabulary = o.vocabulary;
+        c.zipf_exponent = o.zipf;
+        c.median_words = o.median_words;
+        // shorter lines have too few tokens to learn a prefix from
+        c.min_words = static_cast<std::size_t>(o.order);
+        c.seed = seed;
+        return microhal::Corpus(c);
+    }
+
+    bool parse(int argc, char** argv, Options& o) {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            auto value = [&]() -> std::string {
+                if (i + 1 >= argc) { throw std::invalid_argument("missing value for " + arg); }
+                return argv[++i];
+            };
+            if      (arg == "--lines")        { o.lines = std::stoul(value()); }
+            else if (arg == "--ngrams")       { o.ngrams = std::stoul(value()); }
+            else if (arg == "--order")        { o.order = std::stoi(value()); }
+            else if (arg == "--vocabulary")   { o.vocabulary = std::stoul(value()); }
+            else if (arg == "--zipf")         { o.zipf = std::stod(value()); }
+            else if (arg == "--median-words") { o.median_words = std::stod(value()); }
+            else if (arg == "--dump-corpus")  { o.dump_corpus = std::stoul(value()); }
+            else if (arg == "--hash-keys")    { o.hash_keys = std::stoul(value()); }
+            else if (arg == "--min-time")     { o.min_time = std::stod(value()); }
+            else if (arg == "--min-rounds")   { o.min_rounds = std::stoul(value()); }
+            else if (arg == "--format")       { o.format = value(); }
+            else if (arg == "--filter")       { o.filter = value(); }
+            else if (arg == "--seed")         { o.seed = static_cast<unsigned>(std::stoul(value())); }
+            else if (arg == "--no-counters")  { o.counters = false; }
+            else if (arg == "--budget") {
+                auto v = value();
+                auto eq = v.find('=');
+                if (eq == std::string::npos) { throw std::invalid_argument("--budget takes NAME=ALLOCS"); }
+                o.budgets[v.substr(0, eq)] = std::stod(v.substr(eq + 1));
+            }
+            else if (arg == "--no-budgets")   { o.budgets.clear(); }
+            else if (arg == "--budgets-only") { o.budgets_only = true; }
+            else if (arg == "--check-links")  { o.check_links = true; }
+            else {
+                std::cerr << "usage: " << argv[0] << " [--lines N | --ngrams N] [--order N] [--vocabulary N]\n"
+                          << "       [--zipf S] [--median-words N] [--hash-keys N] [--min-time SECONDS]\n"
+                          << "       [--min-rounds N] [--format json|csv] [--filter SUBSTRING] [--seed N]\n"
+                          << "       [--dump-corpus N] [--no-counters] [--budget NAME=ALLOCS] [--no-budgets]\n"
+                          << "       [--budgets-only] [--check-links]\n"
+                          << "--hash-keys defaults to 1000000; use 10000000 for the mphf cases at scale" << std::endl;
+                return false;
+            }
+        }
+        return true;
+    }
+}
+
+int main(int argc, char** argv) {
+    Options o;
+    if (!parse(argc, argv, o)) { return 1; }
+
+    auto text = corpus(o, o.seed);
+    if (o.dump_corpus != 0) {
+        for (std::size_t i = 0; i < o.dump_corpus; ++i) { std::cout << text.line() << "\n"; }
+        return 0;
+    }
+    auto queries = corpus(o, o.seed + 1).lines(1000);
+    std::size_t sink = 0;
+    Suite suite(o);
+
+    // LINKS
+    // Generation must never step into a missing prefix, so no suffix may
+    // lead to a prefix that eviction or decay dropped, while learning or
+    // after a full pass of evict().
+    bool links_ok = true;
+    if (o.check_links) {
+        struct Setup {
+            const char*   name;
+            std::size_t   memory_limit;
+            std::uint32_t half_life;
+        };
+        for (auto& s : {Setup{"evict", 2 << 20, 0}, Setup{"decay", 0, 50}, Setup{"evict_decay", 2 << 20, 50}}) {
+            auto lines = corpus(o, o.seed);
+            microhal::Microhal d(o.order);
+            d.set_memory_limit(s.memory_limit);
+            d.set_half_life(s.half_life);
+            for (std::size_t i = 0; i < 3000; ++i) { d.learn(lines.line()); }
+            auto learned_dangling = BenchmarkAccess::dangling(d);
+            d.evict(d.prefix_count() + d.token_count());
+            auto aged_dangling = BenchmarkAccess::dangling(d);
+            if (learned_dangling != 0 || aged_dangling != 0) {
+                std::cerr << "links_" << s.name << ": " << learned_dangling << " suffixes after learning and "
+                          << aged_dangling << " after a full pass lead to dropped prefixes" << std::endl;
+                links_ok = false;
+            }
+        }
+    }
+
+    // The brain is learned from o.lines lines, or until it holds o.ngrams
+    // prefixes when that is given.
+    std::size_t before = live_bytes;
+    microhal::Microhal m(o.order);
+    std::size_t learned = 0;
+    while (o.ngrams != 0 ? m.prefix_count() < o.ngrams : learned < o.lines) {
+        m.learn(text.line());
+        ++learned;
+    }
+    auto brain_bytes = live_bytes - before;
+    std::cerr << "learned " << learned << " lines, " << m.prefix_count() << " prefixes" << std::endl;
+
+    // TOKENIZE
+    suite.run("tokenize", [&](std::size_t i) {
+        microhal::ScratchScope scope;
+        microhal::ScratchVector<microhal::TokenRef> tokens;
+        microhal::tokenize(queries[i % queries.size()], tokens);
+        sink += tokens.size();
+    });
+
+    // SUFFIX MAP
+    {
+        std::vector<std::string> words;
+        for (std::size_t i = 0; i < 64; ++i) { words.push_back("w" + std::to_string(i * i)); }
+        microhal::SuffixMap sm;
+        suite.run("suffixmap_add", [&](std::size_t i) { sm.add(words[i % words.size()]); });
+        suite.run("suffixmap_get", [&](std::size_t) { sink += sm.get().size(); });
+    }
+
+    // MICROHAL STAGES
+    suite.run("get_best_prefixes", [&](std::size_t i) {
+        sink += BenchmarkAccess::best_prefixes(m, queries[i % queries.size()]);
+    });
+    auto starts = BenchmarkAccess::prefixes(m, 1000);
+    suite.run("build_response", [&](std::size_t i) {
+        sink += BenchmarkAccess::build_response(m, starts[i % starts.size()]).size();
+    });
+    suite.run("microhal_reply", [&](std::size_t i) { sink += m.reply(queries[i % queries.size()]).size(); });
+    // Time to the first streamed token, next to the full reply's ns_per_op.
+    {
+        auto emit = [&](microhal::TokenRef t) { sink += t.size(); };
+        if (auto r = suite.run("microhal_reply_stream", [&](std::size_t i) { m.stream_reply(queries[i % queries.size()], emit); })) {
+            auto& first = m.stats().stage(microhal::Stage::first_token);
+            r->metrics["first_token_mean_ns"] = first.mean();
+            r->metrics["first_token_p99_ns"] = static_cast<double>(first.percentile(99));
+        }
+    }
+    // Length limits trade reply size for time; bytes_per_reply shows how
+    // much each one cuts.
+    {
+        std::vector<std::pair<std::string, microhal::ReplyOptions>> limits(4);
+        limits[0].first = "microhal_reply_tokens_20";
+        limits[0].second.max_tokens = 20;
+        limits[1].first = "microhal_reply_words_20";
+        limits[1].second.max_tokens = 20;
+        limits[1].second.count_words_only = true;
+        limits[2].first = "microhal_reply_bytes_80";
+        limits[2].second.max_bytes = 80;
+        limits[3].first = "microhal_reply_covered";
+        limits[3].second.stop_when_covered = true;
+        for (auto& l : limits) {
+            std::size_t bytes = 0;
+            if (auto r = suite.run(l.first, [&](std::size_t i) {
+                auto reply = m.reply(queries[i % queries.size()], l.second);
+                bytes += reply.size();
+                sink += reply.size();
+            })) {
+                r->metrics["bytes_per_reply"] = static_cast<double>(bytes) / static_cast<double>(r->iterations);
+            }
+        }
+    }
+    // Candidates per reply depend on how much of the budget the candidate
+    // search leaves, so it is reported with the time.
+    for (auto ms : {5, 50}) {
+        microhal::ReplyOptions options;
+        options.budget = std::chrono::milliseconds(ms);
+        auto replies_before = m.stats().counter(microhal::Counter::replies);
+        auto name = "microhal_reply_budget_" + std::to_string(ms) + "ms";
+        if (auto r = suite.run(name, [&](std::size_t i) { sink += m.reply(queries[i % queries.size()], options).size(); })) {
+            auto replies = m.stats().counter(microhal::Counter::replies) - replies_before;
+            r->metrics["candidates_per_reply"] = static_cast<double>(replies) / static_cast<double>(r->iterations);
+        }
+    }
+    // The same budget with one worker per hardware thread also generating,
+    // the pool kept across replies as the server does.
+    {
+        microhal::ThreadPool pool;
+        microhal::ReplyOptions options;
+        options.budget = std::chrono::milliseconds(50);
+        options.pool = &pool;
+        auto replies_before = m.stats().counter(microhal::Counter::replies);
+        if (auto r = suite.run("microhal_reply_budget_50ms_pool", [&](std::size_t i) { sink += m.reply(queries[i % queries.size()], options).size(); })) {
+            auto replies = m.stats().counter(microhal::Counter::replies) - replies_before;
+            r->metrics["candidates_per_reply"] = static_cast<double>(replies) / static_cast<double>(r->iterations);
+            r->metrics["threads"] = static_cast<double>(pool.size() + 1);
+        }
+    }
+    // What a reply costs once it is cancelled: the scan up to its first check.
+    {
+        microhal::CancelToken cancel;
+        cancel.cancel();
+        microhal::ReplyOptions options;
+        options.cancel = &cancel;
+        suite.run("microhal_reply_cancelled", [&](std::size_t i) {
+            try {
+                sink += m.reply(queries[i % queries.size()], options).size();
+            } catch (const microhal::ReplyCancelled&) {
+                ++sink;
+            }
+        });
+    }
+    microhal::set_tracing(true);
+    suite.run("microhal_reply_traced", [&](std::size_t i) { sink += m.reply(queries[i % queries.size()]).size(); });
+    microhal::set_tracing(false);
+    microhal::clear_trace();
+    suite.run("microhal_learn", [&](std::size_t i) { m.learn(queries[i % queries.size()]); });
+    if (auto r = suite.run("microhal_add", [&](std::size_t i) { sink += m.add(queries[i % queries.size()]).size(); })) {
+        r->metrics["brain_bytes"] = static_cast<double>(brain_bytes);
+    }
+    // Replies and queues the input, as the server does with --async-learn.
+    // async_learn is what learning costs the caller in that mode.
+    {
+        std::shared_timed_mutex mutex;
+        microhal::AsyncLearner learner(m, mutex, 64, 4096);
+        auto flush = [&](Result* r) {
+            if (r == nullptr) { return; }
+            auto start = std::chrono::steady_clock::now();
+            r->metrics["pending"] = static_cast<double>(learner.pending());
+            learner.flush();
+            r->metrics["flush_ns"] = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        };
+        flush(suite.run("microhal_add_async", [&](std::size_t i) {
+            auto& q = queries[i % queries.size()];
+            {
+                std::shared_lock<std::shared_timed_mutex> lock(mutex);
+                sink += m.reply(q).size();
+            }
+            learner.learn(q);
+        }));
+        flush(suite.run("async_learn", [&](std::size_t i) { learner.learn(queries[i % queries.size()]); }));
+    }
+
+    // ANALYZE
+    suite.run("analyze_1_thread", [&](std::size_t) { sink += m.analyze(1).prefixes; });
+    suite.run("analyze_threads", [&](std::size_t) { sink += m.analyze().prefixes; });
+
+    // JSON
+    std::string saved;
+    if (auto r = suite.run("json_save", [&](std::size_t) { saved = json(m).dump(); })) {
+        r->metrics["bytes"] = static_cast<double>(saved.size());
+    }
+    if (suite.enabled("json_load")) {
+        if (saved.empty()) { saved = json(m).dump(); }
+        auto r = suite.run("json_load", [&](std::size_t) {
+            auto loaded = json::parse(saved).get<microhal::Microhal>();
+            sink += loaded.memory_usage();
+        });
+        r->metrics["allocs_per_prefix"] = r->metrics["allocs_per_op"] / static_cast<double>(m.prefix_count());
+    }
+
+    // FROZEN
+    before = live_bytes;
+    auto f = m.freeze();
+    auto frozen_bytes = live_bytes - before;
+    if (auto r = suite.run("frozen_freeze", [&](std::size_t) { sink += m.freeze().prefix_count(); })) {
+        r->metrics["frozen_bytes"] = static_cast<double>(frozen_bytes);
+        r->metrics["brain_bytes"] = static_cast<double>(brain_bytes);
+    }
+    suite.run("frozen_reply", [&](std::size_t i) { sink += f.reply(queries[i % queries.size()]).size(); });
+    // the same brain with ids in string order rather than by frequency
+    if (suite.enabled("frozen_reply_lexical")) {
+        microhal::FrozenMicrohal lexical(m, microhal::TokenOrder::lexical);
+        std::ostringstream os;
+        lexical.save(os);
+        auto r = suite.run("frozen_reply_lexical", [&](std::size_t i) { sink += lexical.reply(queries[i % queries.size()]).size(); });
+        r->metrics["snapshot_bytes"] = static_cast<double>(os.str().size());
+    }
+    std::string snapshot;
+    if (auto r = suite.run("frozen_snapshot_save", [&](std::size_t) {
+            std::ostringstream os;
+            f.save(os);
+            snapshot = os.str();
+        })) {
+        r->metrics["snapshot_bytes"] = static_cast<double>(snapshot.size());
+    }
+    if (suite.enabled("frozen_snapshot_load")) {
+        if (snapshot.empty()) {
+            std::ostringstream os;
+            f.save(os);
+            snapshot = os.str();
+        }
+        suite.run("frozen_snapshot_load", [&](std::size_t) {
+            std::istringstream is(snapshot);
+            sink += microhal::FrozenMicrohal::load(is).prefix_count();
+        });
+    }
+    // the same brain with its nodes in traversal order
+    microhal::FrozenMicrohal compacted;
+    suite.run("frozen_compact", [&](std::size_t) { compacted = f.compacted(); });
+    if (suite.enabled("frozen_reply_compacted")) {
+        if (compacted.prefix_count() == 0) { compacted = f.compacted(); }
+        suite.run("frozen_reply_compacted", [&](std::size_t i) { sink += compacted.reply(queries[i % queries.size()]).size(); });
+    }
+    // replies through a handle while another thread compacts and swaps the
+    // brain in a loop
+    if (suite.enabled("frozen_reply_while_compacting")) {
+        microhal::FrozenHandle handle(f);
+        std::atomic<bool> stop(false);
+        std::atomic<std::size_t> swaps(0);
+        std::thread compactor([&]() {
+            while (!stop.load()) {
+                if (handle.compact()) { swaps.fetch_add(1); }
+            }
+        });
+        auto r = suite.run("frozen_reply_while_compacting", [&](std::size_t i) {
+            sink += handle.get()->reply(queries[i % queries.size()]).size();
+        });
+        stop.store(true);
+        compactor.join();
+        r->metrics["swaps"] = static_cast<double>(swaps.load());
+    }
+    // 64 replies per op: one after another, then interleaved in groups of
+    // 1 (the batch machinery alone) and 16.
+    {
+        const std::size_t batch = 64;
+        std::vector<std::vector<std::string>> batches;
+        for (std::size_t b = 0; b < queries.size() / batch; ++b) {
+            batches.emplace_back(queries.begin() + static_cast<std::ptrdiff_t>(b * batch),
+                                 queries.begin() + static_cast<std::ptrdiff_t>((b + 1) * batch));
+        }
+        auto per_second = [&](Result* r) {
+            if (r != nullptr) { r->metrics["replies_per_sec"] = static_cast<double>(r->iterations * batch) / r->seconds; }
+        };
+        per_second(suite.run("frozen_reply_64_sequential", [&](std::size_t i) {
+            for (auto& q : batches[i % batches.size()]) { sink += f.reply(q).size(); }
+        }));
+        if (suite.enabled("frozen_reply_64_sequential_compacted")) {
+            if (compacted.prefix_count() == 0) { compacted = f.compacted(); }
+            per_second(suite.run("frozen_reply_64_sequential_compacted", [&](std::size_t i) {
+                for (auto& q : batches[i % batches.size()]) { sink += compacted.reply(q).size(); }
+            }));
+        }
+        for (std::size_t group : {1, 16}) {
+            per_second(suite.run("frozen_reply_64_batch_group_" + std::to_string(group), [&](std::size_t i) {
+                for (auto& r : f.reply_batch(batches[i % batches.size()], group)) { sink += r.size(); }
+            }));
+        }
+        if (suite.enabled("frozen_reply_64_batch_group_16_compacted")) {
+            if (compacted.prefix_count() == 0) { compacted = f.compacted(); }
+            per_second(suite.run("frozen_reply_64_batch_group_16_compacted", [&](std::size_t i) {
+                for (auto& r : compacted.reply_batch(batches[i % batches.size()], 16)) { sink += r.size(); }
+            }));
+        }
+    }
+
+    // SAMPLING
+    // Searching one suffix set's cumulative counts, as sampling does: the
+    // full scalar and AVX2 counts, std::lower_bound, and count_below.
+    for (std::size_t size : {8, 32, 128, 256, 1024}) {
+        std::mt19937 rng(o.seed);
+        std::vector<std::uint32_t> cumulative(size);
+        std::uint32_t total = 0;
+        for (auto& c : cumulative) { c = total += 1 + rng() % 8; }
+        std::vector<std::uint32_t> stops(4096);
+        for (auto& s : stops) { s = 1 + rng() % total; }
+        auto data = cumulative.data();
+        auto suffix = "_" + std::to_string(size);
+        suite.run("sample_lower_bound" + suffix, [&](std::size_t i) {
+            sink += static_cast<std::size_t>(std::lower_bound(data, data + size, stops[i % stops.size()]) - data);
+        });
+        suite.run("sample_scalar" + suffix, [&](std::size_t i) {
+            sink += microhal::count_below_scalar(data, size, stops[i % stops.size()]);
+        });
+        if (microhal::has_avx2()) {
+            suite.run("sample_avx2" + suffix, [&](std::size_t i) {
+                sink += microhal::count_below_avx2(data, size, stops[i % stops.size()]);
+            });
+        }
+        suite.run("sample_count_below" + suffix, [&](std::size_t i) {
+            sink += microhal::count_below(data, size, stops[i % stops.size()]);
+        });
+    }
+
+    // PERFECT HASH
+    if (suite.enabled("mphf_build") || suite.enabled("mphf_lookup")) {
+        std::vector<std::uint64_t> keys(o.hash_keys);
+        for (std::size_t i = 0; i < keys.size(); ++i) { keys[i] = microhal::hash64(i, 7); }
+        microhal::PerfectHash index(keys);
+        if (auto r = suite.run("mphf_build", [&](std::size_t) { index = microhal::PerfectHash(keys); })) {
+            r->metrics["keys"] = static_cast<double>(keys.size());
+            r->metrics["bits_per_key"] = 8.0 * static_cast<double>(index.memory_usage()) / static_cast<double>(keys.size());
+        }
+        std::shuffle(keys.begin(), keys.end(), std::mt19937(o.seed));
+        suite.run("mphf_lookup", [&](std::size_t i) { sink += index(keys[i % keys.size()]); });
+    }
+
+    std::map<std::string, json> context = {
+        {"lines", learned},
+        {"order", o.order},
+        {"vocabulary", o.vocabulary},
+        {"zipf", o.zipf},
+        {"median_words", o.median_words},
+        {"seed", o.seed},
+        {"prefixes", f.prefix_count()},
+        {"compiler", __VERSION__},
+        {"timestamp", static_cast<long long>(std::time(nullptr))},
+        {"sink", sink}
+    };
+    suite.report(std::cout, context);
+    return suite.within_budgets() && links_ok ? 0 : 1;
+}
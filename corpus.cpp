@@ -0,0 +1,74 @@
+#include <algorithm>
+#include <cmath>
+
+#include "corpus.hpp"
+
+namespace microhal {
+    namespace {
+        const char* const syllables[] = {
+            "ka", "lo", "mi", "ne", "ru", "sa", "to", "vi", "be", "di",
+            "fo", "gu", "ha", "je", "ko", "ly", "po", "qu", "we", "zi"
+        };
+        const std::size_t syllable_count = sizeof(syllables) / sizeof(syllables[0]);
+    }
+
+    Corpus::Corpus(const CorpusOptions& options)
+    : m_options(options), m_rng(options.seed) {
+        auto n = std::max<std::size_t>(1, m_options.vocabulary);
+        m_cdf.resize(n);
+        m_words.reserve(n);
+        double total = 0;
+        for (std::size_t r = 0; r < n; ++r) {
+            total += 1.0 / std::pow(static_cast<double>(r + 1), m_options.zipf_exponent);
+            m_cdf[r] = total;
+
+            // the syllables of the rank written in base syllable_count
+            std::string w;
+            auto x = r;
+            do {
+                w += syllables[x % syllable_count];
+                x /= syllable_count;
+            } while (x > 0);
+            m_words.push_back(w);
+        }
+        for (auto& c : m_cdf) { c /= total; }
+    }
+
+    std::size_t Corpus::rank() {
+        auto u = std::uniform_real_distribution<double>(0.0, 1.0)(m_rng);
+        auto it = std::upper_bound(m_cdf.begin(), m_cdf.end(), u);
+        return std::min(static_cast<std::size_t>(it - m_cdf.begin()), m_cdf.size() - 1);
+    }
+
+    const std::string& Corpus::word(std::size_t rank) const {
+        return m_words[rank];
+    }
+
+    std::string Corpus::line() {
+        std::lognormal_distribution<double> length(std::log(m_options.median_words), m_options.words_sigma);
+        std::uniform_real_distribution<double> chance(0.0, 1.0);
+        auto words = static_cast<std::size_t>(std::max(1L, std::lround(length(m_rng))));
+        words = std::min(m_options.max_words, std::max(m_options.min_words, words));
+
+        std::string out;
+        if (chance(m_rng) < m_options.edge_space) { out += ' '; }
+        for (std::size_t i = 0; i < words; ++i) {
+            if (i > 0) {
+                auto c = chance(m_rng);
+                if      (c < m_options.tab)                         { out += '\t'; }
+                else if (c < m_options.tab + m_options.double_space) { out += "  "; }
+                else                                                 { out += ' '; }
+            }
+            out += word(rank());
+        }
+        if (chance(m_rng) < m_options.edge_space) { out += ' '; }
+        return out;
+    }
+
+    std::vector<std::string> Corpus::lines(std::size_t n) {
+        std::vector<std::string> out;
+        out.reserve(n);
+        for (std::size_t i = 0; i < n; ++i) { out.push_back(line()); }
+        return out;
+    }
+}
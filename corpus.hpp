@@ -0,0 +1,46 @@
+#ifndef MICROHAL_CORPUS_H
+#define MICROHAL_CORPUS_H
+
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace microhal {
+
+    struct CorpusOptions {
+        std::size_t   vocabulary = 10000;
+        double        zipf_exponent = 1.0;
+        // line lengths in words are log-normal around the median
+        double        median_words = 8.0;
+        double        words_sigma = 0.6;
+        std::size_t   min_words = 1;
+        std::size_t   max_words = 200;
+        // probabilities of whitespace variations seen in chat input
+        double        double_space = 0.03;
+        double        tab = 0.005;
+        double        edge_space = 0.02;
+        std::uint64_t seed = 42;
+    };
+
+    // Generates reproducible synthetic chat lines. Words are drawn from a
+    // Zipf distribution over the vocabulary, and a word's spelling is built
+    // from syllables of its rank, so frequent words are short like in real
+    // text.
+    class Corpus {
+        CorpusOptions            m_options;
+        std::mt19937_64          m_rng;
+        std::vector<double>      m_cdf;
+        std::vector<std::string> m_words;
+
+    public:
+        explicit Corpus(const CorpusOptions& options = CorpusOptions());
+
+        std::size_t rank();
+        const std::string& word(std::size_t rank) const;
+        std::string line();
+        std::vector<std::string> lines(std::size_t n);
+    };
+}
+
+#endif
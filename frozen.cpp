@@ -0,0 +1,678 @@
+#include <algorithm>
+#include <istream>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <ostream>
+#include <stdexcept>
+
+#include "frozen.hpp"
+#include "search.hpp"
+
+namespace microhal {
+    namespace {
+        std::uint32_t checked(std::size_t n) {
+            if (n > std::numeric_limits<std::uint32_t>::max()) {
+                throw std::runtime_error("FrozenMicrohal: brain too large to freeze");
+            }
+            return static_cast<std::uint32_t>(n);
+        }
+
+        // most tokens in a reply, counting its starting prefix
+        const std::size_t reply_limit = 100;
+
+        template<typename T>
+        std::size_t bytes(const std::vector<T>& v) {
+            return v.capacity() * sizeof(T);
+        }
+
+        const char snapshot_magic[4] = {'M', 'H', 'F', '1'};
+
+        // LEB128: seven bits per byte, low bits first, the high bit set on
+        // every byte but the last.
+        void put_varint(std::string& out, std::uint64_t v) {
+            while (v >= 0x80) {
+                out.push_back(static_cast<char>(v | 0x80));
+                v >>= 7;
+            }
+            out.push_back(static_cast<char>(v));
+        }
+
+        struct Reader {
+            const char* cursor;
+            const char* end;
+
+            std::uint64_t varint() {
+                std::uint64_t v = 0;
+                for (unsigned shift = 0; shift < 64; shift += 7) {
+                    if (cursor == end) { break; }
+                    auto b = static_cast<unsigned char>(*cursor++);
+                    v |= static_cast<std::uint64_t>(b & 0x7f) << shift;
+                    if ((b & 0x80) == 0) { return v; }
+                }
+                throw std::runtime_error("FrozenMicrohal: corrupt snapshot");
+            }
+
+            std::uint32_t u32() {
+                auto v = varint();
+                if (v > std::numeric_limits<std::uint32_t>::max()) { throw std::runtime_error("FrozenMicrohal: corrupt snapshot"); }
+                return static_cast<std::uint32_t>(v);
+            }
+
+            const char* bytes(std::size_t n) {
+                if (static_cast<std::size_t>(end - cursor) < n) { throw std::runtime_error("FrozenMicrohal: corrupt snapshot"); }
+                auto p = cursor;
+                cursor += n;
+                return p;
+            }
+        };
+    }
+
+    // SUFFIXES
+    typename FrozenMicrohal::Id FrozenMicrohal::Suffixes::sample() const {
+        if (size == 0) { return 0; }
+        auto stop = static_cast<std::uint32_t>(random(1, static_cast<int>(cumulative[size - 1])));
+        return tokens[count_below(cumulative, size, stop)];
+    }
+
+    // FROZEN MICROHAL
+    FrozenMicrohal::FrozenMicrohal() : m_order(0), m_seed(0) {
+    }
+
+    FrozenMicrohal::FrozenMicrohal(const Microhal& m, TokenOrder order) : m_order(m.m_order), m_seed(0) {
+        // Intern every token the brain refers to, in a table sorted by string
+        // so the empty token comes first and ids can be looked up.
+        std::vector<TokenRef> table(1, TokenRef());
+        for (auto& kw : m.m_keywords) { table.push_back(kw.first); }
+        for (auto& p : m.m_prefixes) {
+            table.insert(table.end(), p.first.begin(), p.first.end());
+            for (auto s : p.second.first) { table.push_back(s.first); }
+            for (auto s : p.second.second) { table.push_back(s.first); }
+        }
+        std::sort(table.begin(), table.end());
+        table.erase(std::unique(table.begin(), table.end()), table.end());
+
+        std::vector<std::uint32_t> counts(table.size(), 0);
+        for (auto& kw : m.m_keywords) {
+            auto i = std::lower_bound(table.begin(), table.end(), TokenRef(kw.first)) - table.begin();
+            counts[static_cast<std::size_t>(i)] = static_cast<std::uint32_t>(std::max(m.keyword_count(kw.second), 0));
+        }
+
+        // Number the tokens, most frequent first unless lexical order is
+        // asked for. The empty token keeps id 0 either way.
+        std::vector<std::size_t> by_id(table.size());
+        std::iota(by_id.begin(), by_id.end(), 0);
+        if (order == TokenOrder::frequency) {
+            std::stable_sort(by_id.begin() + 1, by_id.end(), [&](std::size_t a, std::size_t b) { return counts[a] > counts[b]; });
+        }
+        std::vector<Id> ids(table.size());
+        for (std::size_t id = 0; id < by_id.size(); ++id) { ids[by_id[id]] = static_cast<Id>(id); }
+        auto id_of = [&](TokenRef t) {
+            return ids[static_cast<std::size_t>(std::lower_bound(table.begin(), table.end(), t) - table.begin())];
+        };
+
+        m_token_offsets.reserve(table.size() + 1);
+        m_token_offsets.push_back(0);
+        m_keyword_counts.reserve(table.size());
+        for (auto i : by_id) {
+            m_text.append(table[i].data(), table[i].size());
+            m_token_offsets.push_back(checked(m_text.size()));
+            m_keyword_counts.push_back(counts[i]);
+        }
+        m_sorted = ids;
+
+        // Hash every prefix key, picking a seed under which no two keys share
+        // a 64-bit hash, and build the perfect hash over the hashes.
+        auto order_size = static_cast<std::size_t>(m_order);
+        auto count = m.m_prefixes.size();
+        std::vector<Id> keys;
+        keys.reserve(count * order_size);
+        for (auto& p : m.m_prefixes) {
+            for (auto& t : p.first) { keys.push_back(id_of(t)); }
+        }
+        std::vector<std::uint64_t> hashes(count);
+        for (;; ++m_seed) {
+            for (std::size_t i = 0; i < count; ++i) { hashes[i] = key_hash(keys.data() + i * order_size); }
+            auto sorted = hashes;
+            std::sort(sorted.begin(), sorted.end());
+            if (std::adjacent_find(sorted.begin(), sorted.end()) == sorted.end()) { break; }
+        }
+        m_index = PerfectHash(hashes);
+
+        // Lay prefixes and their suffixes out in slot order.
+        std::vector<PrefixMap::const_iterator> by_slot(count);
+        {
+            std::size_t i = 0;
+            for (auto it = m.m_prefixes.begin(); it != m.m_prefixes.end(); ++it, ++i) {
+                by_slot[checked(m_index(hashes[i]))] = it;
+            }
+        }
+        // Counts are frozen as decayed to the brain's current period, and
+        // suffixes are stored in id order, so hot ones come first.
+        auto period = m.period();
+        Entries backward;
+        Entries forward;
+        auto entries = [&](Entries& out, const SuffixMap& sm) {
+            auto periods = period > sm.period() ? period - sm.period() : 0;
+            out.clear();
+            for (auto s : sm) {
+                auto c = decay(s.second, periods);
+                if (c != 0) { out.emplace_back(id_of(s.first), static_cast<std::uint32_t>(c)); }
+            }
+            std::sort(out.begin(), out.end());
+        };
+        std::size_t words = 0;
+        for (auto& p : m.m_prefixes) { words += 2 + 2 * (p.second.first.entry_count() + p.second.second.entry_count()); }
+        m_nodes.reserve(words);
+        m_keys.resize(count * order_size);
+        m_slots.reserve(count);
+        for (std::size_t slot = 0; slot < count; ++slot) {
+            auto& p = *by_slot[slot];
+            auto key = m_keys.data() + slot * order_size;
+            std::transform(p.first.begin(), p.first.end(), key, id_of);
+            m_slots.push_back(Slot{static_cast<std::uint32_t>(key_hash(key) >> 32), checked(m_nodes.size())});
+            entries(backward, p.second.first);
+            entries(forward, p.second.second);
+            append_node(backward, forward);
+        }
+        index_occurrences();
+    }
+
+    void FrozenMicrohal::append_node(const Entries& backward, const Entries& forward) {
+        m_nodes.push_back(checked(backward.size()));
+        m_nodes.push_back(checked(forward.size()));
+        for (auto side : {&backward, &forward}) {
+            for (auto& e : *side) { m_nodes.push_back(e.first); }
+            std::size_t total = 0;
+            for (auto& e : *side) { m_nodes.push_back(checked(total += e.second)); }
+        }
+    }
+
+    typename FrozenMicrohal::Suffixes FrozenMicrohal::suffixes(const std::uint32_t* node, bool backward) const {
+        auto size = backward ? node[0] : node[1];
+        auto first = node + 2 + (backward ? 0 : 2 * node[0]);
+        return Suffixes{first, first + size, size};
+    }
+
+    typename FrozenMicrohal::Suffixes FrozenMicrohal::suffixes(std::size_t slot, bool backward) const {
+        return suffixes(m_nodes.data() + m_slots[slot].node, backward);
+    }
+
+    void FrozenMicrohal::index_occurrences() {
+        // Keyword index: for every token, the slots of the prefixes containing
+        // it. Built with a counting sort over (token, prefix) pairs.
+        auto order = static_cast<std::size_t>(m_order);
+        auto count = prefix_count();
+        auto distinct = [&](std::size_t slot, std::size_t pos) {
+            auto key = m_keys.data() + slot * order;
+            return std::find(key, key + pos, key[pos]) == key + pos;
+        };
+        m_occurrence_offsets.assign(token_count() + 1, 0);
+        for (std::size_t i = 0; i < count; ++i) {
+            for (std::size_t pos = 0; pos < order; ++pos) {
+                if (distinct(i, pos)) { ++m_occurrence_offsets[m_keys[i * order + pos] + 1]; }
+            }
+        }
+        std::partial_sum(m_occurrence_offsets.begin(), m_occurrence_offsets.end(), m_occurrence_offsets.begin());
+        m_occurrences.resize(m_occurrence_offsets.back());
+        auto fill = m_occurrence_offsets;
+        for (std::size_t i = 0; i < count; ++i) {
+            for (std::size_t pos = 0; pos < order; ++pos) {
+                if (distinct(i, pos)) { m_occurrences[fill[m_keys[i * order + pos]]++] = checked(i); }
+            }
+        }
+    }
+
+    TokenRef FrozenMicrohal::token(Id id) const {
+        return TokenRef(m_text.data() + m_token_offsets[id], m_token_offsets[id + 1] - m_token_offsets[id]);
+    }
+
+    bool FrozenMicrohal::find_token(TokenRef t, Id& id) const {
+        auto it = std::lower_bound(m_sorted.begin(), m_sorted.end(), t, [&](Id a, TokenRef b) { return token(a) < b; });
+        if (it == m_sorted.end() || token(*it) != t) { return false; }
+        id = *it;
+        return true;
+    }
+
+    std::uint64_t FrozenMicrohal::key_hash(const Id* key) const {
+        std::uint64_t h = static_cast<std::uint64_t>(m_order);
+        for (int i = 0; i < m_order; ++i) {
+            h = hash64(h ^ key[i], m_seed);
+        }
+        return h;
+    }
+
+    bool FrozenMicrohal::find_prefix(const Id* key, std::size_t& index) const {
+        auto h = key_hash(key);
+        auto slot = m_index(h);
+        if (slot >= prefix_count() || m_slots[slot].fingerprint != static_cast<std::uint32_t>(h >> 32)) {
+            return false;
+        }
+        index = slot;
+        return true;
+    }
+
+    std::string FrozenMicrohal::join(const Id* first, const Id* last) const {
+        std::size_t size = 0;
+        for (auto it = first; it != last; ++it) { size += token(*it).size(); }
+        std::string ret;
+        ret.reserve(size);
+        for (auto it = first; it != last; ++it) {
+            auto t = token(*it);
+            ret.append(t.data(), t.size());
+        }
+        return ret;
+    }
+
+    std::string FrozenMicrohal::build_response(std::size_t prefix) const {
+        auto order = static_cast<std::size_t>(m_order);
+        ScratchVector<Id> buffer(2 * reply_limit + order);
+        auto first = buffer.data() + reply_limit;
+        auto key = m_keys.data() + prefix * order;
+        auto last = first;
+        for (std::size_t i = 0; i < order; ++i) { *last++ = key[i]; }
+
+        auto next = [&](const Id* k, bool backward) -> Id {
+            std::size_t index;
+            if (!find_prefix(k, index)) { return 0; }
+            return suffixes(index, backward).sample();
+        };
+
+        auto length = order;
+        while (length < reply_limit && (*first != 0 || *std::prev(last) != 0)) {
+            if (*first != 0) {
+                auto t = next(first, true);
+                *--first = t;
+                ++length;
+            }
+            if (*std::prev(last) != 0) {
+                auto t = next(last - order, false);
+                *last++ = t;
+                ++length;
+            }
+        }
+        return join(first, last);
+    }
+
+    bool FrozenMicrohal::start_prefix(const std::string& input, std::size_t& prefix) const {
+        ScratchVector<TokenRef> tokens;
+        tokenize(input, tokens);
+
+        ScratchVector<Id> keywords;
+        for (auto& t : tokens) {
+            Id id;
+            if (find_token(t, id)) { keywords.push_back(id); }
+        }
+
+        // Rarest keyword first; unknown counts are tried last, as in Microhal.
+        auto rank = [&](Id id) {
+            auto c = m_keyword_counts[id];
+            return c == 0 ? std::numeric_limits<std::uint32_t>::max() : c;
+        };
+        std::sort(keywords.begin(), keywords.end(), [&](Id a, Id b) {
+            if (rank(a) == rank(b)) { return a < b; }
+            return rank(a) < rank(b);
+        });
+
+        for (auto id : keywords) {
+            auto first = m_occurrence_offsets[id];
+            auto last = m_occurrence_offsets[id + 1];
+            if (first != last) {
+                auto i = random(0, static_cast<int>(last - first) - 1);
+                prefix = m_occurrences[first + static_cast<std::uint32_t>(i)];
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::string FrozenMicrohal::reply(const std::string& input) const {
+        ScratchScope scope;
+        std::size_t prefix;
+        if (!start_prefix(input, prefix)) { return "Nope, nothing"; }
+        return build_response(prefix);
+    }
+
+    // BATCHED REPLIES
+    void FrozenMicrohal::start_walk(Walk& w, std::size_t prefix, Id* buffer) const {
+        auto order = static_cast<std::size_t>(m_order);
+        auto key = m_keys.data() + prefix * order;
+        w.buffer = buffer;
+        w.first = buffer + reply_limit;
+        w.last = std::copy(key, key + order, w.first);
+        w.length = order;
+        w.side = Walk::Side::round;
+        w.stage = Walk::Stage::hash;
+    }
+
+    bool FrozenMicrohal::next_step(Walk& w) const {
+        // The same order as build_response: every round adds a backward and
+        // then a forward token, skipping sides that have ended.
+        while (true) {
+            if (w.side == Walk::Side::round) {
+                if (w.length >= reply_limit || (*w.first == 0 && *std::prev(w.last) == 0)) { return false; }
+                w.side = Walk::Side::backward;
+            }
+            if (w.side == Walk::Side::backward) {
+                if (*w.first != 0) { return true; }
+                w.side = Walk::Side::forward;
+            }
+            if (*std::prev(w.last) != 0) { return true; }
+            w.side = Walk::Side::round;
+        }
+    }
+
+    bool FrozenMicrohal::advance(Walk& w) const {
+        auto backward = w.side == Walk::Side::backward;
+        switch (w.stage) {
+        case Walk::Stage::hash:
+            w.hash = key_hash(backward ? w.first : w.last - m_order);
+            m_index.prefetch(w.hash);
+            w.stage = Walk::Stage::slot;
+            return true;
+        case Walk::Stage::slot:
+            w.slot = m_index(w.hash);
+            __builtin_prefetch(m_slots.data() + w.slot);
+            w.stage = Walk::Stage::range;
+            return true;
+        case Walk::Stage::range:
+            w.node = nullptr;
+            if (w.slot < prefix_count() && m_slots[w.slot].fingerprint == static_cast<std::uint32_t>(w.hash >> 32)) {
+                // Where the sampled side starts depends on the node itself,
+                // so its first two lines are loaded, which holds most nodes.
+                w.node = m_nodes.data() + m_slots[w.slot].node;
+                __builtin_prefetch(w.node);
+                __builtin_prefetch(w.node + 16);
+            }
+            w.stage = Walk::Stage::sample;
+            return true;
+        case Walk::Stage::sample: {
+            auto t = w.node == nullptr ? 0 : suffixes(w.node, backward).sample();
+            if (backward) {
+                *--w.first = t;
+                w.side = Walk::Side::forward;
+            } else {
+                *w.last++ = t;
+                w.side = Walk::Side::round;
+            }
+            ++w.length;
+            w.stage = Walk::Stage::hash;
+            return next_step(w);
+        }
+        }
+        return false;
+    }
+
+    std::vector<std::string> FrozenMicrohal::reply_batch(const std::vector<std::string>& inputs, std::size_t group) const {
+        ScratchScope scope;
+        std::vector<std::string> replies(inputs.size());
+        group = std::max<std::size_t>(1, std::min(group, inputs.size()));
+        auto stride = 2 * reply_limit + static_cast<std::size_t>(m_order);
+        ScratchVector<Id> buffers(group * stride);
+        ScratchVector<Walk> walks(group);
+
+        // Starts w on the next input that needs walking, answering the ones
+        // without a starting prefix, or that end at once, on the way.
+        std::size_t next = 0;
+        auto refill = [&](Walk& w) {
+            while (next < inputs.size()) {
+                auto i = next++;
+                std::size_t prefix;
+                if (!start_prefix(inputs[i], prefix)) {
+                    replies[i] = "Nope, nothing";
+                    continue;
+                }
+                start_walk(w, prefix, w.buffer);
+                w.input = i;
+                if (next_step(w)) { return true; }
+                replies[i] = join(w.first, w.last);
+            }
+            return false;
+        };
+
+        std::size_t active = 0;
+        for (std::size_t g = 0; g < group; ++g) {
+            walks[active].buffer = buffers.data() + g * stride;
+            if (refill(walks[active])) { ++active; }
+        }
+        while (active != 0) {
+            for (std::size_t g = 0; g < active;) {
+                auto& w = walks[g];
+                if (advance(w)) { ++g; continue; }
+                replies[w.input] = join(w.first, w.last);
+                if (refill(w)) { ++g; continue; }
+                std::swap(w, walks[--active]);
+            }
+        }
+        return replies;
+    }
+
+    std::size_t FrozenMicrohal::prefix_count() const {
+        return m_slots.size();
+    }
+
+    std::size_t FrozenMicrohal::token_count() const {
+        return m_token_offsets.empty() ? 0 : m_token_offsets.size() - 1;
+    }
+
+    std::size_t FrozenMicrohal::memory_usage() const {
+        return sizeof(*this) + m_text.capacity() + bytes(m_token_offsets) + bytes(m_keyword_counts)
+            + bytes(m_sorted) + bytes(m_keys) + bytes(m_slots) + bytes(m_nodes)
+            + m_index.memory_usage()
+            + bytes(m_occurrence_offsets) + bytes(m_occurrences);
+    }
+
+    // SNAPSHOT
+    void FrozenMicrohal::save(std::ostream& os) const {
+        TraceSpan span("frozen_save");
+        std::string out(snapshot_magic, sizeof(snapshot_magic));
+        put_varint(out, static_cast<std::uint64_t>(m_order));
+        put_varint(out, m_seed);
+        put_varint(out, token_count());
+        for (Id id = 0; id < token_count(); ++id) {
+            auto t = token(id);
+            put_varint(out, t.size());
+            out.append(t.data(), t.size());
+        }
+        for (auto c : m_keyword_counts) { put_varint(out, c); }
+
+        // Prefixes go in node order, so a loaded brain keeps its layout. Per
+        // prefix: the key, the suffix counts of each direction, then the
+        // suffixes with their own counts rather than cumulative ones.
+        auto order = static_cast<std::size_t>(m_order);
+        std::vector<std::uint32_t> by_node(prefix_count());
+        std::iota(by_node.begin(), by_node.end(), 0);
+        std::sort(by_node.begin(), by_node.end(), [&](std::uint32_t a, std::uint32_t b) { return m_slots[a].node < m_slots[b].node; });
+        put_varint(out, prefix_count());
+        for (auto slot : by_node) {
+            for (std::size_t i = 0; i < order; ++i) { put_varint(out, m_keys[slot * order + i]); }
+            auto backward = suffixes(slot, true);
+            auto forward = suffixes(slot, false);
+            put_varint(out, backward.size);
+            put_varint(out, forward.size);
+            for (auto& side : {backward, forward}) {
+                for (std::uint32_t i = 0; i < side.size; ++i) {
+                    put_varint(out, side.tokens[i]);
+                    put_varint(out, side.cumulative[i] - (i == 0 ? 0 : side.cumulative[i - 1]));
+                }
+            }
+        }
+        os.write(out.data(), static_cast<std::streamsize>(out.size()));
+    }
+
+    FrozenMicrohal FrozenMicrohal::load(std::istream& is) {
+        TraceSpan span("frozen_load");
+        std::string in((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+        Reader r{in.data(), in.data() + in.size()};
+        if (!std::equal(snapshot_magic, snapshot_magic + sizeof(snapshot_magic), r.bytes(sizeof(snapshot_magic)))) {
+            throw std::runtime_error("FrozenMicrohal: not a snapshot");
+        }
+
+        FrozenMicrohal f;
+        f.m_order = static_cast<int>(r.u32());
+        f.m_seed = r.varint();
+        auto tokens = r.u32();
+        f.m_token_offsets.reserve(static_cast<std::size_t>(tokens) + 1);
+        f.m_token_offsets.push_back(0);
+        for (std::uint32_t id = 0; id < tokens; ++id) {
+            auto size = r.u32();
+            f.m_text.append(r.bytes(size), size);
+            f.m_token_offsets.push_back(checked(f.m_text.size()));
+        }
+        f.m_keyword_counts.resize(tokens);
+        for (auto& c : f.m_keyword_counts) { c = r.u32(); }
+        f.m_sorted.resize(tokens);
+        std::iota(f.m_sorted.begin(), f.m_sorted.end(), 0);
+        std::sort(f.m_sorted.begin(), f.m_sorted.end(), [&](Id a, Id b) { return f.token(a) < f.token(b); });
+
+        auto order = static_cast<std::size_t>(f.m_order);
+        auto count = r.u32();
+        auto id = [&]() {
+            auto v = r.u32();
+            if (v >= tokens) { throw std::runtime_error("FrozenMicrohal: corrupt snapshot"); }
+            return v;
+        };
+        auto entries = [&](Entries& out, std::uint32_t n) {
+            out.clear();
+            for (std::uint32_t i = 0; i < n; ++i) {
+                auto t = id();
+                out.emplace_back(t, r.u32());
+            }
+        };
+        // Nodes are read in their stored order; keys wait in that order too
+        // until the perfect hash says which slot each belongs to.
+        std::vector<Id> keys(static_cast<std::size_t>(count) * order);
+        std::vector<std::uint32_t> nodes(count);
+        std::vector<std::uint64_t> hashes(count);
+        Entries backward;
+        Entries forward;
+        for (std::size_t i = 0; i < count; ++i) {
+            auto key = keys.data() + i * order;
+            for (std::size_t j = 0; j < order; ++j) { key[j] = id(); }
+            hashes[i] = f.key_hash(key);
+            nodes[i] = checked(f.m_nodes.size());
+            auto b = r.u32();
+            auto n = r.u32();
+            entries(backward, b);
+            entries(forward, n);
+            f.append_node(backward, forward);
+        }
+
+        // The perfect hash is a function of the key hashes alone, so it
+        // comes out the same and must map the keys to distinct slots.
+        f.m_index = PerfectHash(hashes);
+        f.m_keys.resize(keys.size());
+        f.m_slots.assign(count, Slot{0, 0});
+        std::vector<bool> filled(count, false);
+        for (std::size_t i = 0; i < count; ++i) {
+            auto slot = f.m_index(hashes[i]);
+            if (slot >= count || filled[slot]) { throw std::runtime_error("FrozenMicrohal: corrupt snapshot"); }
+            filled[slot] = true;
+            std::copy(keys.begin() + static_cast<std::ptrdiff_t>(i * order), keys.begin() + static_cast<std::ptrdiff_t>((i + 1) * order),
+                      f.m_keys.begin() + static_cast<std::ptrdiff_t>(slot * order));
+            f.m_slots[slot] = Slot{static_cast<std::uint32_t>(hashes[i] >> 32), nodes[i]};
+        }
+        f.m_nodes.shrink_to_fit();
+        f.index_occurrences();
+        return f;
+    }
+
+    // LAYOUT
+    FrozenMicrohal FrozenMicrohal::compacted() const {
+        TraceSpan span("frozen_compact");
+        auto order = static_cast<std::size_t>(m_order);
+        auto count = prefix_count();
+        // how often each prefix was seen, its total suffix count
+        std::vector<std::uint64_t> weights(count, 0);
+        for (std::size_t slot = 0; slot < count; ++slot) {
+            for (auto backward : {true, false}) {
+                auto s = suffixes(slot, backward);
+                if (s.size != 0) { weights[slot] += s.cumulative[s.size - 1]; }
+            }
+        }
+        std::vector<std::uint32_t> seeds(count);
+        std::iota(seeds.begin(), seeds.end(), 0);
+        std::stable_sort(seeds.begin(), seeds.end(), [&](std::uint32_t a, std::uint32_t b) { return weights[a] > weights[b]; });
+
+        // Depth first from every prefix not yet placed, heaviest first, and
+        // from each prefix on to its likeliest neighbour first, so a node
+        // tends to sit right after the one a walk most often comes from. A
+        // step backward prepends a suffix to the key and drops its last
+        // token, a step forward drops the first token and appends one.
+        std::vector<bool> placed(count, false);
+        std::vector<std::uint32_t> layout;
+        layout.reserve(count);
+        std::vector<std::uint32_t> stack;
+        std::vector<std::pair<std::uint32_t, std::uint32_t>> next;
+        std::vector<Id> key(order);
+        for (auto seed : seeds) {
+            stack.push_back(seed);
+            while (!stack.empty()) {
+                auto slot = stack.back();
+                stack.pop_back();
+                if (placed[slot]) { continue; }
+                placed[slot] = true;
+                layout.push_back(slot);
+
+                auto from = m_keys.data() + slot * order;
+                next.clear();
+                for (auto backward : {true, false}) {
+                    auto s = suffixes(slot, backward);
+                    for (std::uint32_t i = 0; i < s.size; ++i) {
+                        if (s.tokens[i] == 0) { continue; }
+                        if (backward) {
+                            key[0] = s.tokens[i];
+                            std::copy(from, from + order - 1, key.begin() + 1);
+                        } else {
+                            std::copy(from + 1, from + order, key.begin());
+                            key[order - 1] = s.tokens[i];
+                        }
+                        std::size_t to;
+                        if (find_prefix(key.data(), to) && !placed[to]) {
+                            next.emplace_back(s.cumulative[i] - (i == 0 ? 0 : s.cumulative[i - 1]), checked(to));
+                        }
+                    }
+                }
+                // least likely pushed first, so the likeliest is popped next
+                std::stable_sort(next.begin(), next.end(), [](const std::pair<std::uint32_t, std::uint32_t>& a,
+                                                              const std::pair<std::uint32_t, std::uint32_t>& b) {
+                    return a.first < b.first;
+                });
+                for (auto& n : next) { stack.push_back(n.second); }
+            }
+        }
+
+        auto f = *this;
+        f.m_nodes.clear();
+        for (auto slot : layout) {
+            auto node = m_nodes.data() + m_slots[slot].node;
+            f.m_slots[slot].node = checked(f.m_nodes.size());
+            f.m_nodes.insert(f.m_nodes.end(), node, node + 2 + 2 * (node[0] + node[1]));
+        }
+        return f;
+    }
+
+    // HANDLE
+    FrozenHandle::FrozenHandle(FrozenMicrohal brain) : m_current(std::make_shared<const FrozenMicrohal>(std::move(brain))) {
+    }
+
+    std::shared_ptr<const FrozenMicrohal> FrozenHandle::get() const {
+        return std::atomic_load(&m_current);
+    }
+
+    void FrozenHandle::set(FrozenMicrohal brain) {
+        std::atomic_store(&m_current, std::shared_ptr<const FrozenMicrohal>(std::make_shared<const FrozenMicrohal>(std::move(brain))));
+    }
+
+    bool FrozenHandle::compact() {
+        auto current = get();
+        std::shared_ptr<const FrozenMicrohal> next = std::make_shared<const FrozenMicrohal>(current->compacted());
+        return std::atomic_compare_exchange_strong(&m_current, &current, next);
+    }
+
+    // MICROHAL
+    FrozenMicrohal Microhal::freeze() const {
+        return FrozenMicrohal(*this);
+    }
+}
@@ -0,0 +1,144 @@
+#ifndef MICROHAL_FROZEN_H
+#define MICROHAL_FROZEN_H
+
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "microhal.hpp"
+#include "mphf.hpp"
+
+namespace microhal {
+
+    // How a frozen brain numbers its tokens.
+    enum class TokenOrder { frequency, lexical };
+
+    // Immutable snapshot of a Microhal for read-only serving. Tokens are
+    // interned as ids, by default the most frequent first so that hot
+    // tokens sit together and take the fewest bytes in a snapshot.
+    //
+    // Prefix keys are stored in the slot order of a minimal perfect hash.
+    // Each slot record holds a fingerprint of the key and the offset of the
+    // prefix's node: its backward and forward suffixes with cumulative
+    // counts, one after another in a single buffer, so sampling is a search
+    // over one contiguous range (see count_below). Finding the next prefix
+    // during generation is one hash evaluation, one record read and one
+    // node read.
+    //
+    // Nodes are first laid out in slot order, which is as good as random
+    // for a walk. compacted() lays them out again in traversal order, so the
+    // steps of a walk tend to stay on the same pages.
+    class FrozenMicrohal {
+    public:
+        using Id = std::uint32_t;
+
+    private:
+        struct Slot {
+            std::uint32_t fingerprint;
+            std::uint32_t node;
+        };
+
+        // One direction of a node. A node is the backward and forward
+        // suffix counts followed by the tokens and cumulative counts of
+        // each direction in turn.
+        struct Suffixes {
+            const Id*            tokens;
+            const std::uint32_t* cumulative;
+            std::uint32_t        size;
+
+            Id sample() const;
+        };
+        using Entries = std::vector<std::pair<Id, std::uint32_t>>;
+
+        // A reply in progress in reply_batch, and the stage of its next step.
+        struct Walk {
+            enum class Stage { hash, slot, range, sample };
+            enum class Side { round, backward, forward };
+
+            std::size_t   input;
+            Id*           buffer;
+            Id*           first;
+            Id*           last;
+            std::size_t   length;
+            Side          side;
+            Stage         stage;
+            std::uint64_t hash;
+            std::size_t   slot;
+            // the node sampled from, or null where the walk ends
+            const std::uint32_t* node;
+        };
+
+        int                        m_order;
+        std::uint64_t              m_seed;
+        std::string                m_text;
+        std::vector<std::uint32_t> m_token_offsets;
+        std::vector<std::uint32_t> m_keyword_counts;
+        // ids in string order, for finding a token's id
+        std::vector<Id>            m_sorted;
+        std::vector<Id>            m_keys;
+        std::vector<Slot>          m_slots;
+        std::vector<std::uint32_t> m_nodes;
+        PerfectHash                m_index;
+        std::vector<std::uint32_t> m_occurrence_offsets;
+        std::vector<std::uint32_t> m_occurrences;
+
+        TokenRef token(Id id) const;
+        bool find_token(TokenRef t, Id& id) const;
+        std::uint64_t key_hash(const Id* key) const;
+        bool find_prefix(const Id* key, std::size_t& index) const;
+        void append_node(const Entries& backward, const Entries& forward);
+        Suffixes suffixes(const std::uint32_t* node, bool backward) const;
+        Suffixes suffixes(std::size_t slot, bool backward) const;
+        void index_occurrences();
+        bool start_prefix(const std::string& input, std::size_t& prefix) const;
+        std::string join(const Id* first, const Id* last) const;
+        std::string build_response(std::size_t prefix) const;
+        void start_walk(Walk& w, std::size_t prefix, Id* buffer) const;
+        bool next_step(Walk& w) const;
+        bool advance(Walk& w) const;
+
+    public:
+        FrozenMicrohal();
+        explicit FrozenMicrohal(const Microhal& m, TokenOrder order = TokenOrder::frequency);
+
+        // Binary snapshot with ids and counts as varints. The perfect hash
+        // and keyword index are rebuilt on load rather than stored.
+        void save(std::ostream& os) const;
+        static FrozenMicrohal load(std::istream& is);
+
+        // A copy with the nodes laid out in traversal order: depth first
+        // from the most used prefixes, stepping to the likeliest neighbour
+        // first.
+        FrozenMicrohal compacted() const;
+
+        std::string reply(const std::string& input) const;
+        // Replies to every input, advancing up to group walks in turn. Each
+        // step of a walk is split into stages that prefetch what the next
+        // stage reads, so the cache misses of one walk are waited out while
+        // the others run.
+        std::vector<std::string> reply_batch(const std::vector<std::string>& inputs, std::size_t group = 16) const;
+        std::size_t prefix_count() const;
+        std::size_t token_count() const;
+        std::size_t memory_usage() const;
+    };
+
+    // The frozen brain being served, which can be replaced while replies
+    // run. A reader keeps the brain it got from get() for as long as it
+    // uses it, and a replaced brain is freed once its last reader is done.
+    class FrozenHandle {
+        std::shared_ptr<const FrozenMicrohal> m_current;
+
+    public:
+        explicit FrozenHandle(FrozenMicrohal brain);
+
+        std::shared_ptr<const FrozenMicrohal> get() const;
+        void set(FrozenMicrohal brain);
+        // Swaps in the current brain compacted, unless it was replaced in
+        // the meantime. Safe to run on a background thread while serving.
+        bool compact();
+    };
+}
+
+#endif
@@ -0,0 +1,95 @@
+#include <algorithm>
+#include <vector>
+
+#include "learner.hpp"
+
+namespace microhal {
+    AsyncLearner::AsyncLearner(Microhal& brain, std::shared_timed_mutex& mutex, std::size_t batch, std::size_t max_pending)
+    : m_brain(brain), m_brain_mutex(mutex), m_batch(std::max<std::size_t>(1, batch)), m_max_pending(std::max<std::size_t>(1, max_pending)),
+      m_queued(0), m_applied(0), m_failed(0), m_idle(false) {
+        m_thread = std::thread(&AsyncLearner::run, this);
+    }
+
+    AsyncLearner::~AsyncLearner() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopping = true;
+        }
+        m_wake.notify_one();
+        m_thread.join();
+    }
+
+    void AsyncLearner::learn(std::string input) {
+        if (pending() >= m_max_pending) {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_wake.notify_one();
+            m_done.wait(lock, [&]() { return pending() < m_max_pending; });
+        }
+        // counted before it is pushed, and in sequence with reading m_idle,
+        // so an idle learner either finds the counts apart or is notified
+        m_queued.fetch_add(1);
+        m_queue.push(std::move(input));
+        // only a learner that has run out of work needs waking
+        if (m_idle.load(std::memory_order_seq_cst)) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_wake.notify_one();
+        }
+    }
+
+    void AsyncLearner::flush() {
+        auto target = m_queued.load();
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_wake.notify_one();
+        m_done.wait(lock, [&]() { return m_applied.load() >= target; });
+    }
+
+    std::uint64_t AsyncLearner::pending() const {
+        return m_queued.load(std::memory_order_relaxed) - m_applied.load(std::memory_order_relaxed);
+    }
+
+    std::uint64_t AsyncLearner::failed() const {
+        return m_failed.load(std::memory_order_relaxed);
+    }
+
+    void AsyncLearner::run() {
+        std::vector<std::string> batch;
+        batch.reserve(m_batch);
+        while (true) {
+            std::string input;
+            while (batch.size() < m_batch && m_queue.pop(input)) { batch.push_back(std::move(input)); }
+
+            if (batch.empty()) {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                if (m_stopping && m_applied.load() == m_queued.load()) { return; }
+                // The flag is raised before the counts are compared, so a
+                // producer either sees it and notifies under m_mutex, or has
+                // already counted its message. learn() counts a message
+                // before pushing it, so one still being linked keeps the
+                // counts apart and the loop goes back to the queue.
+                m_idle.store(true, std::memory_order_seq_cst);
+                if (m_applied.load() == m_queued.load()) {
+                    m_wake.wait(lock);
+                }
+                m_idle.store(false, std::memory_order_relaxed);
+                continue;
+            }
+
+            {
+                std::unique_lock<std::shared_timed_mutex> lock(m_brain_mutex);
+                for (auto& b : batch) {
+                    try {
+                        m_brain.learn(b);
+                    } catch (const std::exception&) {
+                        m_failed.fetch_add(1, std::memory_order_relaxed);
+                    }
+                }
+            }
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_applied.fetch_add(batch.size());
+            }
+            m_done.notify_all();
+            batch.clear();
+        }
+    }
+}
@@ -0,0 +1,55 @@
+#ifndef MICROHAL_LEARNER_H
+#define MICROHAL_LEARNER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+
+#include "microhal.hpp"
+#include "mpsc.hpp"
+
+namespace microhal {
+
+    // Learns messages on a background thread, so callers can reply without
+    // waiting for the brain to be updated. Messages are queued without
+    // locks and applied in batches of up to batch, each under one exclusive
+    // lock of mutex. Readers of the brain must hold mutex shared. Once
+    // max_pending messages wait, learn() blocks until the learner catches up.
+    class AsyncLearner {
+        Microhal&                  m_brain;
+        std::shared_timed_mutex&   m_brain_mutex;
+        std::size_t                m_batch;
+        std::size_t                m_max_pending;
+        MpscQueue<std::string>     m_queue;
+        std::atomic<std::uint64_t> m_queued;
+        std::atomic<std::uint64_t> m_applied;
+        std::atomic<std::uint64_t> m_failed;
+        std::atomic<bool>          m_idle;
+        bool                       m_stopping = false;
+        std::mutex                 m_mutex;
+        std::condition_variable    m_wake;
+        std::condition_variable    m_done;
+        std::thread                m_thread;
+
+        void run();
+
+    public:
+        AsyncLearner(Microhal& brain, std::shared_timed_mutex& mutex, std::size_t batch = 64, std::size_t max_pending = 65536);
+        ~AsyncLearner();
+        AsyncLearner(const AsyncLearner&) = delete;
+        AsyncLearner& operator=(const AsyncLearner&) = delete;
+
+        void learn(std::string input);
+        // Returns once every message queued before the call is learned.
+        void flush();
+        std::uint64_t pending() const;
+        // messages the brain refused, such as ones shorter than its order
+        std::uint64_t failed() const;
+    };
+}
+
+#endif
@@ -0,0 +1,196 @@
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "corpus.hpp"
+#include "stats.hpp"
+
+// Closed-loop load generator for the line protocol server: every
+// connection sends a request, waits for its answer and sends the next.
+namespace {
+    struct Options {
+        std::string              address = "tcp:5555";
+        std::vector<std::size_t> concurrency = {1, 4, 16, 64};
+        double                   duration = 5.0;
+        std::string              command = "reply";
+        std::size_t              learn = 2000;
+        std::size_t              vocabulary = 5000;
+        unsigned                 seed = 42;
+    };
+
+    int connect_to(const std::string& address) {
+        int fd;
+        int result;
+        if (address.compare(0, 5, "unix:") == 0) {
+            sockaddr_un addr;
+            std::memset(&addr, 0, sizeof(addr));
+            addr.sun_family = AF_UNIX;
+            std::strncpy(addr.sun_path, address.c_str() + 5, sizeof(addr.sun_path) - 1);
+            fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+            result = ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+        } else {
+            sockaddr_in addr;
+            std::memset(&addr, 0, sizeof(addr));
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(static_cast<std::uint16_t>(std::stoul(address.substr(4))));
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            fd = ::socket(AF_INET, SOCK_STREAM, 0);
+            result = ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+            int one = 1;
+            ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        if (fd < 0 || result < 0) {
+            throw std::runtime_error("cannot connect to " + address + ": " + std::strerror(errno));
+        }
+        return fd;
+    }
+
+    class Client {
+        int         m_fd;
+        std::string m_buffer;
+
+    public:
+        explicit Client(const std::string& address) : m_fd(connect_to(address)) {}
+        ~Client() { ::close(m_fd); }
+        Client(const Client&) = delete;
+        Client& operator=(const Client&) = delete;
+
+        std::string request(const std::string& line) {
+            auto out = line + "\n";
+            for (std::size_t sent = 0; sent < out.size();) {
+                auto n = ::send(m_fd, out.data() + sent, out.size() - sent, MSG_NOSIGNAL);
+                if (n <= 0) { throw std::runtime_error("connection lost"); }
+                sent += static_cast<std::size_t>(n);
+            }
+            std::size_t end;
+            while ((end = m_buffer.find('\n')) == std::string::npos) {
+                char buffer[4096];
+                auto n = ::recv(m_fd, buffer, sizeof(buffer), 0);
+                if (n <= 0) { throw std::runtime_error("connection lost"); }
+                m_buffer.append(buffer, static_cast<std::size_t>(n));
+            }
+            auto answer = m_buffer.substr(0, end);
+            m_buffer.erase(0, end + 1);
+            return answer;
+        }
+    };
+
+    microhal::Corpus corpus(const Options& o, unsigned seed) {
+        microhal::CorpusOptions c;
+        c.vocabulary = o.vocabulary;
+        c.min_words = 4;
+        c.seed = seed;
+        return microhal::Corpus(c);
+    }
+
+    std::string micros(std::uint64_t ns) {
+        std::ostringstream os;
+        os << std::fixed << std::setprecision(1) << static_cast<double>(ns) / 1e3;
+        return os.str();
+    }
+
+    void level(const Options& o, std::size_t connections) {
+        microhal::LatencyHistogram latency;
+        std::atomic<std::uint64_t> errors(0);
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::duration<double>(o.duration);
+        auto start = std::chrono::steady_clock::now();
+
+        std::vector<std::thread> threads;
+        for (std::size_t i = 0; i < connections; ++i) {
+            threads.emplace_back([&, i]() {
+                try {
+                    Client client(o.address);
+                    auto text = corpus(o, o.seed + 1 + static_cast<unsigned>(i));
+                    while (std::chrono::steady_clock::now() < deadline) {
+                        auto line = o.command + " " + text.line();
+                        auto t = std::chrono::steady_clock::now();
+                        auto answer = client.request(line);
+                        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t);
+                        latency.record(static_cast<std::uint64_t>(ns.count()));
+                        if (answer.compare(0, 6, "error ") == 0) { errors.fetch_add(1); }
+                    }
+                } catch (const std::exception& e) {
+                    std::cerr << e.what() << std::endl;
+                    errors.fetch_add(1);
+                }
+            });
+        }
+        for (auto& t : threads) { t.join(); }
+        auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        std::cout << std::setw(12) << connections
+                  << std::setw(12) << latency.count()
+                  << std::setw(12) << std::fixed << std::setprecision(0) << static_cast<double>(latency.count()) / elapsed
+                  << std::setw(12) << micros(static_cast<std::uint64_t>(latency.mean()))
+                  << std::setw(12) << micros(latency.percentile(50))
+                  << std::setw(12) << micros(latency.percentile(99))
+                  << std::setw(12) << micros(latency.percentile(99.9))
+                  << std::setw(12) << micros(latency.max())
+                  << std::setw(12) << errors.load() << std::endl;
+    }
+
+    bool parse(int argc, char** argv, Options& o) {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            auto value = [&]() -> std::string {
+                if (i + 1 >= argc) { throw std::invalid_argument("missing value for " + arg); }
+                return argv[++i];
+            };
+            if      (arg == "--address")     { o.address = value(); }
+            else if (arg == "--duration")    { o.duration = std::stod(value()); }
+            else if (arg == "--command")     { o.command = value(); }
+            else if (arg == "--learn")       { o.learn = std::stoul(value()); }
+            else if (arg == "--vocabulary")  { o.vocabulary = std::stoul(value()); }
+            else if (arg == "--seed")        { o.seed = static_cast<unsigned>(std::stoul(value())); }
+            else if (arg == "--concurrency") {
+                o.concurrency.clear();
+                std::istringstream levels(value());
+                std::string n;
+                while (std::getline(levels, n, ',')) { o.concurrency.push_back(std::stoul(n)); }
+            }
+            else {
+                std::cerr << "usage: " << argv[0] << " [--address unix:PATH|tcp:PORT] [--concurrency N,N,...]\n"
+                          << "       [--duration SECONDS] [--command reply|add|learn] [--learn LINES]\n"
+                          << "       [--vocabulary N] [--seed N]" << std::endl;
+                return false;
+            }
+        }
+        return true;
+    }
+}
+
+int main(int argc, char** argv) {
+    Options o;
+    if (!parse(argc, argv, o)) { return 1; }
+
+    try {
+        // give the brain something to reply from
+        if (o.learn != 0) {
+            Client client(o.address);
+            auto text = corpus(o, o.seed);
+            for (std::size_t i = 0; i < o.learn; ++i) { client.request("learn " + text.line()); }
+        }
+
+        std::cout << std::setw(12) << "connections" << std::setw(12) << "requests" << std::setw(12) << "req/s"
+                  << std::setw(12) << "mean us" << std::setw(12) << "p50 us" << std::setw(12) << "p99 us"
+                  << std::setw(12) << "p999 us" << std::setw(12) << "max us" << std::setw(12) << "errors" << std::endl;
+        for (auto c : o.concurrency) { level(o, c); }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
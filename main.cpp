@@ -0,0 +1,108 @@
+#include <csignal>
+#include <fstream>
+#include <iostream>
+
+#include "microhal.hpp"
+#include "report.hpp"
+#include "server.hpp"
+
+namespace {
+    microhal::Server* running_server = nullptr;
+
+    void stop_server(int) {
+        if (running_server != nullptr) { running_server->stop(); }
+    }
+
+    int serve(int argc, char** argv) {
+        microhal::ServerOptions options;
+        bool load = false;
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            if      (arg == "--serve" && i + 1 < argc)   { options.address = argv[++i]; }
+            else if (arg == "--workers" && i + 1 < argc) { options.workers = std::stoul(argv[++i]); }
+            else if (arg == "--db" && i + 1 < argc)      { options.db = argv[++i]; }
+            else if (arg == "--load")                    { load = true; }
+            else if (arg == "--async-learn")             { options.async_learn = true; }
+            else if (arg == "--generation-threads" && i + 1 < argc) { options.generation_threads = std::stoul(argv[++i]); }
+            else if (arg == "--pool-tasks" && i + 1 < argc)  { options.reply.pool_tasks = std::stoul(argv[++i]); }
+            else if (arg == "--max-tokens" && i + 1 < argc)  { options.reply.max_tokens = std::stoul(argv[++i]); }
+            else if (arg == "--max-bytes" && i + 1 < argc)   { options.reply.max_bytes = std::stoul(argv[++i]); }
+            else if (arg == "--count-words")                 { options.reply.count_words_only = true; }
+            else if (arg == "--stop-when-covered")           { options.reply.stop_when_covered = true; }
+            else if (arg == "--cancel-stale")                { options.cancel_stale = true; }
+            else if (arg == "--no-learn-on-cancel")          { options.reply.learn_on_cancel = false; }
+            else if (arg == "--reply-budget" && i + 1 < argc) {
+                options.reply.budget = std::chrono::microseconds(static_cast<long>(std::stod(argv[++i]) * 1e3));
+            }
+            else {
+                std::cerr << "usage: " << argv[0] << " [--serve unix:PATH|tcp:PORT [--workers N] [--db FILE] [--load] [--async-learn] [--reply-budget MS] [--generation-threads N]\n"
+                          << "       [--pool-tasks N] [--max-tokens N] [--max-bytes N] [--count-words] [--stop-when-covered]\n"
+                          << "       [--cancel-stale] [--no-learn-on-cancel]]" << std::endl;
+                return 1;
+            }
+        }
+
+        microhal::Microhal m(4);
+        if (load) {
+            std::ifstream i(options.db);
+            json j;
+            i >> j;
+            from_json(j, m);
+        }
+        microhal::Server server(m, options);
+        running_server = &server;
+        std::signal(SIGINT, stop_server);
+        std::signal(SIGTERM, stop_server);
+        std::cerr << "serving on " << options.address << " with " << options.workers << " workers" << std::endl;
+        server.run();
+        running_server = nullptr;
+        return 0;
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1) { return serve(argc, argv); }
+
+    microhal::Microhal m(4);
+    std::string in;
+    std::cout << "HEJ!!!!" << std::endl;
+    while (std::getline(std::cin, in)) {
+        if (in == "\\quit" || in == "\\exit") { break; }
+        else if (in == "\\save") {
+            std::ofstream o("db.json");
+            o << json(m) << std::endl;
+        }
+        else if (in == "\\load") {
+            std::ifstream i("db.json");
+            json j;
+            i >> j;
+            from_json(j, m);
+        }
+        else if (in == "\\stats") {
+            std::cout << m.stats()
+                      << "prefixes: " << m.prefix_count() << "\n"
+                      << "tokens: " << m.token_count() << "\n"
+                      << "memory: " << m.memory_usage() << " bytes" << std::endl;
+        }
+        else if (in == "\\trace on")  { microhal::set_tracing(true); }
+        else if (in == "\\trace off") { microhal::set_tracing(false); }
+        else if (in.compare(0, 12, "\\trace dump ") == 0) {
+            std::ofstream o(in.substr(12));
+            std::cout << microhal::write_trace(o) << " spans" << std::endl;
+            microhal::clear_trace();
+        }
+        else if (in == "\\slow") { std::cout << m.slow_log(); }
+        else if (in.compare(0, 11, "\\slow dump ") == 0) {
+            std::ofstream o(in.substr(11));
+            o << m.slow_log();
+        }
+        else if (in.compare(0, 6, "\\slow ") == 0) {
+            // threshold in milliseconds, 0 turns the log off
+            m.slow_log().set_threshold(static_cast<std::uint64_t>(std::stod(in.substr(6)) * 1e6));
+        }
+        else if (in == "\\analyze") { std::cout << m.analyze(); }
+        else if (in == "\\analyze json") { std::cout << json(m.analyze()).dump(2) << std::endl; }
+        else { std::cout << m.add(in) << std::endl; }
+    }
+
+}
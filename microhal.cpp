@@ -1,38 +1,177 @@
 #include <algorithm>
-#include <deque>
+#include <cmath>
+#include <cstring>
+#include <ctime>
 #include <fstream>
 #include <iostream>
 #include <iterator>
+#include <limits>
 #include <random>
-#include <sstream>
 #include <vector>
 
 #include "microhal.hpp"
+#include "pool.hpp"
 
 namespace microhal {
-    std::vector<Token> tokenize(const std::string& s) {
-        std::vector<Token> tokens;
+    namespace {
+        // Estimated heap cost of brain entries: a tree node (three links and
+        // a color, rounded up for the allocator) plus out-of-line strings.
+        const std::size_t node_bytes = 6 * sizeof(void*);
+        const std::size_t inline_chars = std::string().capacity();
+        const std::size_t eviction_steps = 256;
+        // visits per learned token, enough to outpace the entries it adds
+        const std::size_t aging_steps = 2;
+
+        // prefixes the candidate scan visits between checks for cancellation
+        const std::size_t cancel_stride = 4096;
+
+        void check(const CancelToken* cancel) {
+            if (cancel != nullptr && cancel->cancelled()) { throw ReplyCancelled(); }
+        }
+
+        // Tokens that fit on either side of a reply's starting prefix, plus
+        // one for the empty token that ends a side. Whitespace and words
+        // alternate, so counting words only at most doubles the tokens.
+        std::size_t reply_room(const ReplyOptions& options) {
+            return (options.count_words_only ? 2 * options.max_tokens + 1 : options.max_tokens) + 1;
+        }
+
+        std::string join(const TokenRef* first, const TokenRef* last) {
+            size_t bytes = 0;
+            for (auto it = first; it != last; ++it) { bytes += it->size(); }
+            std::string ret;
+            ret.reserve(bytes);
+            for (auto it = first; it != last; ++it) { ret.append(it->data(), it->size()); }
+            return ret;
+        }
+
+        std::size_t string_bytes(std::size_t length) {
+            return length > inline_chars ? length + 1 : 0;
+        }
+
+        template<typename Key>
+        std::size_t key_bytes(const Key& key) {
+            std::size_t bytes = node_bytes + sizeof(PrefixMap::value_type);
+            for (auto& t : key) {
+                bytes += sizeof(Token) + string_bytes(TokenRef(t).size());
+            }
+            return bytes;
+        }
+    }
+
+    std::size_t entry_bytes(TokenRef t) {
+        return node_bytes + sizeof(std::pair<const std::string, int>) + string_bytes(t.size());
+    }
+
+    std::size_t prefix_bytes(const Prefix& p) {
+        return key_bytes(p);
+    }
+
+    std::size_t prefix_bytes(PrefixRef p) {
+        return key_bytes(p);
+    }
+
+    // TOKEN REF
+    TokenRef::TokenRef() : m_data(""), m_size(0) {
+    }
+
+    TokenRef::TokenRef(const char* data, std::size_t size) : m_data(data), m_size(size) {
+    }
+
+    TokenRef::TokenRef(const Token& t) : m_data(t.data()), m_size(t.size()) {
+    }
+
+    const char* TokenRef::data() const {
+        return m_data;
+    }
+
+    std::size_t TokenRef::size() const {
+        return m_size;
+    }
+
+    bool TokenRef::empty() const {
+        return m_size == 0;
+    }
+
+    Token TokenRef::str() const {
+        return Token(m_data, m_size);
+    }
+
+    int compare(TokenRef a, TokenRef b) {
+        auto n = std::min(a.m_size, b.m_size);
+        auto c = n == 0 ? 0 : std::memcmp(a.m_data, b.m_data, n);
+        if (c != 0) { return c; }
+        return a.m_size < b.m_size ? -1 : (a.m_size > b.m_size ? 1 : 0);
+    }
+
+    bool operator<(TokenRef a, TokenRef b) {
+        return compare(a, b) < 0;
+    }
+
+    bool operator==(TokenRef a, TokenRef b) {
+        return a.size() == b.size() && compare(a, b) == 0;
+    }
+
+    bool operator!=(TokenRef a, TokenRef b) {
+        return !(a == b);
+    }
+
+    std::ostream& operator<<(std::ostream& os, TokenRef t) {
+        return os.write(t.m_data, static_cast<std::streamsize>(t.m_size));
+    }
+
+    void tokenize(const std::string& s, ScratchVector<TokenRef>& tokens) {
         auto start = s.begin();
         for(auto it = s.begin(); it != s.end(); ++it) {
             auto end = std::next(it);
             if(end == s.end() || ::isspace(*it) != ::isspace(*end)) {
-                std::ostringstream os;
-                std::copy(start, end, std::ostream_iterator<char>(os));
-                tokens.push_back(os.str());
+                tokens.emplace_back(&*start, static_cast<std::size_t>(end - start));
                 start = end;
             }
         }
+    }
+
+    std::vector<Token> tokenize(const std::string& s) {
+        ScratchScope scope;
+        ScratchVector<TokenRef> refs;
+        tokenize(s, refs);
+        std::vector<Token> tokens;
+        tokens.reserve(refs.size());
+        for (auto& t : refs) {
+            tokens.push_back(t.str());
+        }
         return tokens;
     }
 
     int random(int min, int max) {
-        static std::random_device srd;
-        static std::mt19937 mt(srd());
+        // one generator per thread, so concurrent replies need no lock
+        thread_local std::random_device srd;
+        thread_local std::mt19937 mt(srd());
         auto dist = std::uniform_int_distribution<int>(min, max);
         auto x = dist(mt);
         return x;
     }
 
+    int decay(int count, std::uint32_t periods) {
+        return periods >= 31 ? 0 : count >> periods;
+    }
+
+    // PREFIX REF
+    PrefixRef::PrefixRef(const TokenRef* start, const TokenRef* stop, int order)
+    : m_begin(start), m_end(stop) {
+        if (std::distance(start, stop) != static_cast<std::ptrdiff_t>(order)) {
+            throw std::runtime_error("Prefix::Prefix: Must init with order tokens.");
+        }
+    }
+
+    const TokenRef* PrefixRef::begin() const {
+        return m_begin;
+    }
+
+    const TokenRef* PrefixRef::end() const {
+        return m_end;
+    }
+
     //PREFIX
     template<typename InputIterator>
     Prefix::Prefix(InputIterator start, InputIterator stop, int order)
@@ -43,6 +182,14 @@ namespace microhal {
         std::copy(start, stop, m_tokens.begin());
     }
 
+    Prefix::Prefix(PrefixRef ref)
+    : m_order(static_cast<int>(std::distance(ref.begin(), ref.end()))) {
+        m_tokens.reserve(static_cast<size_type>(m_order));
+        for (auto& t : ref) {
+            m_tokens.emplace_back(t.data(), t.size());
+        }
+    }
+
     typename Prefix::const_iterator Prefix::begin() const {
         return m_tokens.begin();
     }
@@ -55,140 +202,754 @@ namespace microhal {
         return m_tokens < other.m_tokens;
     }
 
+    bool operator<(const Prefix& p, PrefixRef r) {
+        return std::lexicographical_compare(p.begin(), p.end(), r.begin(), r.end(),
+            [](TokenRef a, TokenRef b) { return a < b; });
+    }
+
+    bool operator<(PrefixRef r, const Prefix& p) {
+        return std::lexicographical_compare(r.begin(), r.end(), p.begin(), p.end(),
+            [](TokenRef a, TokenRef b) { return a < b; });
+    }
+
     std::ostream& operator<<(std::ostream& os, const Prefix& p) {
         return os << json(p);
     }
 
     // SUFFIX MAP
-    SuffixMap::SuffixMap() : m_total(0) {
+    SuffixMap::SuffixMap() : m_total(0), m_period(0), m_width(1) {
     }
 
-    size_t SuffixMap::size() const {
-        return m_total;
+    std::size_t SuffixMap::find(TokenRef suffix) const {
+        auto it = std::lower_bound(m_tokens.begin(), m_tokens.end(), suffix,
+                                   [](const std::string& a, TokenRef b) { return TokenRef(a) < b; });
+        return static_cast<std::size_t>(it - m_tokens.begin());
     }
 
-    void SuffixMap::add(const std::string& suffix) {
-        if (m_suffixes.find(suffix) == m_suffixes.end()) {
-            m_suffixes[suffix] = 1;
+    std::uint32_t SuffixMap::count_at(std::size_t i) const {
+        auto p = m_counts.data() + i * m_width;
+        if (m_width == 1) { return static_cast<std::uint8_t>(*p); }
+        if (m_width == 2) {
+            std::uint16_t c;
+            std::memcpy(&c, p, sizeof(c));
+            return c;
+        }
+        std::uint32_t c;
+        std::memcpy(&c, p, sizeof(c));
+        return c;
+    }
+
+    void SuffixMap::set_count(std::size_t i, std::uint32_t count) {
+        auto p = &m_counts[i * m_width];
+        if (m_width == 1) {
+            *p = static_cast<char>(count);
+        } else if (m_width == 2) {
+            auto c = static_cast<std::uint16_t>(count);
+            std::memcpy(p, &c, sizeof(c));
         } else {
-            m_suffixes[suffix] += 1;
+            std::memcpy(p, &count, sizeof(count));
         }
+    }
+
+    std::size_t SuffixMap::fit(std::uint32_t count) {
+        // Widens the counts until count fits, returning the bytes added.
+        std::uint8_t width = count <= 0xff ? 1 : count <= 0xffff ? 2 : 4;
+        if (width <= m_width) { return 0; }
+        SuffixMap wide;
+        wide.m_width = width;
+        wide.m_counts.resize(m_tokens.size() * width);
+        for (std::size_t i = 0; i < m_tokens.size(); ++i) { wide.set_count(i, count_at(i)); }
+        auto added = m_tokens.size() * static_cast<std::size_t>(width - m_width);
+        m_counts.swap(wide.m_counts);
+        m_width = width;
+        return added;
+    }
+
+    std::size_t SuffixMap::entry_bytes(std::size_t i) const {
+        return sizeof(std::string) + m_width + string_bytes(m_tokens[i].size());
+    }
+
+    size_t SuffixMap::size() const {
+        return m_total;
+    }
+
+    bool SuffixMap::empty() const {
+        return m_tokens.empty();
+    }
+
+    std::size_t SuffixMap::entry_count() const {
+        return m_tokens.size();
+    }
+
+    std::size_t SuffixMap::width() const {
+        return m_width;
+    }
+
+    std::uint32_t SuffixMap::period() const {
+        return m_period;
+    }
+
+    typename SuffixMap::const_iterator SuffixMap::begin() const {
+        return const_iterator(this, 0);
+    }
+
+    typename SuffixMap::const_iterator SuffixMap::end() const {
+        return const_iterator(this, m_tokens.size());
+    }
+
+    std::size_t SuffixMap::add(TokenRef suffix) {
         m_total += 1;
+        auto i = find(suffix);
+        if (i < m_tokens.size() && TokenRef(m_tokens[i]) == suffix) {
+            auto c = count_at(i) + 1;
+            auto added = fit(c);
+            set_count(i, c);
+            return added;
+        }
+        m_tokens.insert(m_tokens.begin() + static_cast<std::ptrdiff_t>(i), suffix.str());
+        m_counts.insert(i * m_width, m_width, '\0');
+        set_count(i, 1);
+        return entry_bytes(i);
+    }
+
+    int SuffixMap::count(TokenRef suffix) const {
+        auto i = find(suffix);
+        return i < m_tokens.size() && TokenRef(m_tokens[i]) == suffix ? static_cast<int>(count_at(i)) : 0;
     }
 
-    std::string SuffixMap::get() const {
-        if (size() == 0) { return ""; }
-        auto stop = random(1, m_total);
+    std::size_t SuffixMap::remove(TokenRef suffix) {
+        auto i = find(suffix);
+        if (i == m_tokens.size() || TokenRef(m_tokens[i]) != suffix) { return 0; }
+        auto freed = entry_bytes(i);
+        m_total -= count_at(i);
+        m_tokens.erase(m_tokens.begin() + static_cast<std::ptrdiff_t>(i));
+        m_counts.erase(i * m_width, m_width);
+        return freed;
+    }
+
+    std::size_t SuffixMap::age(std::uint32_t period) {
+        if (period <= m_period) { return 0; }
+        auto periods = period - m_period;
+        m_period = period;
+        std::size_t freed = 0;
+        std::size_t kept = 0;
+        m_total = 0;
+        for (std::size_t i = 0; i < m_tokens.size(); ++i) {
+            auto c = static_cast<std::uint32_t>(decay(static_cast<int>(count_at(i)), periods));
+            if (c == 0) {
+                freed += entry_bytes(i);
+                continue;
+            }
+            if (kept != i) { m_tokens[kept] = std::move(m_tokens[i]); }
+            set_count(kept++, c);
+            m_total += c;
+        }
+        m_tokens.resize(kept);
+        m_counts.resize(kept * m_width);
+        return freed;
+    }
+
+    TokenRef SuffixMap::get(std::uint32_t period) const {
+        // Sample from the counts as they would be after aging to period,
+        // without writing them back.
+        auto periods = period > m_period ? period - m_period : 0;
+        std::size_t total = m_total;
+        if (periods != 0) {
+            total = 0;
+            for (std::size_t i = 0; i < m_tokens.size(); ++i) {
+                total += static_cast<size_t>(decay(static_cast<int>(count_at(i)), periods));
+            }
+        }
+        if (total == 0) { return TokenRef(); }
+        auto stop = random(1, static_cast<int>(total));
         auto current = 0;
-        for (auto& it : m_suffixes) {
-            current += it.second;
-            if (current >= stop) { return it.first; }
+        for (std::size_t i = 0; i < m_tokens.size(); ++i) {
+            current += decay(static_cast<int>(count_at(i)), periods);
+            if (current >= stop) { return m_tokens[i]; }
         }
         throw std::runtime_error("SuffixMap::get: OOB");
     }
 
+    std::size_t SuffixMap::memory_usage() const {
+        std::size_t bytes = 0;
+        for (std::size_t i = 0; i < m_tokens.size(); ++i) { bytes += entry_bytes(i); }
+        return bytes;
+    }
+
     std::ostream& operator<<(std::ostream& os, const SuffixMap& m) {
         return os << json(m);
     }
 
     // MICROHAL
-    auto& Microhal::suffixes(const Prefix& p) {
-        if (m_prefixes.find(p) == m_prefixes.end()) {
-            m_prefixes[p] = std::make_pair(SuffixMap(), SuffixMap());
+    std::pair<SuffixMap, SuffixMap>& Microhal::suffixes(PrefixRef p) {
+        auto it = m_prefixes.find(p);
+        if (it == m_prefixes.end()) {
+            it = m_prefixes.emplace(Prefix(p), std::make_pair(SuffixMap(), SuffixMap())).first;
+            m_memory += prefix_bytes(p);
         }
-        return m_prefixes[p];
+        return it->second;
     }
 
-    void Microhal::add_keyword(const std::string& kw) {
-        if (m_keywords.find(kw) == m_keywords.end()) {
-            m_keywords[kw] = 1;
-        } else if (m_keywords[kw] + 1 > m_keywords[kw]) {
-            m_keywords[kw] += 1;
+    template<typename P>
+    void Microhal::unlink(const P& prefix, const std::pair<SuffixMap, SuffixMap>& s, std::uint32_t period, bool all) {
+        // Drop the suffix entries that lead into this prefix through its own
+        // entries, all of them or those that decay away by period: (x, t1..tn-1)
+        // continues with tn for every backward suffix x, and (t2..tn, y)
+        // continues backwards with t1 for every forward suffix y. Both
+        // entries count the same n-gram, so they decay away together.
+        if (!all && period <= s.first.period() && period <= s.second.period()) { return; }
+        ScratchScope scope;
+        auto order = static_cast<size_t>(m_order);
+        ScratchVector<TokenRef> key(order + 1);
+        auto dropped = [&](const SuffixMap& sm, int count) {
+            return all || decay(count, period > sm.period() ? period - sm.period() : 0) == 0;
+        };
+
+        std::copy(prefix.begin(), prefix.end(), key.begin() + 1);
+        for (auto e : s.first) {
+            if (e.first.empty() || !dropped(s.first, e.second)) { continue; }
+            key[0] = e.first;
+            auto q = m_prefixes.find(PrefixRef(key.data(), key.data() + order, m_order));
+            if (q != m_prefixes.end()) { m_memory -= q->second.second.remove(key[order]); }
+        }
+
+        std::copy(prefix.begin(), prefix.end(), key.begin());
+        for (auto e : s.second) {
+            if (e.first.empty() || !dropped(s.second, e.second)) { continue; }
+            key[order] = e.first;
+            auto r = m_prefixes.find(PrefixRef(key.data() + 1, key.data() + 1 + order, m_order));
+            if (r != m_prefixes.end()) { m_memory -= r->second.first.remove(key[0]); }
         }
     }
 
-    auto Microhal::get_best_prefixes(std::vector<Token> keywords) const {
+    template<typename P>
+    void Microhal::age_prefix(const P& prefix, std::pair<SuffixMap, SuffixMap>& s) {
+        // Unlinked first, as aging drops the entries that name the neighbours.
+        auto current = period();
+        unlink(prefix, s, current, false);
+        m_memory -= s.first.age(current) + s.second.age(current);
+    }
+
+    // Every suffix entry leads to a prefix the brain holds, with or without
+    // decay, so generation never steps into a missing prefix: prefixes are
+    // unlinked as they are erased, and entries as they decay away.
+    PrefixMap::iterator Microhal::erase_prefix(PrefixMap::iterator it) {
+        auto& p = it->first;
+        unlink(p, it->second, 0, true);
+        m_memory -= prefix_bytes(p) + it->second.first.memory_usage() + it->second.second.memory_usage();
+        return m_prefixes.erase(it);
+    }
+
+    std::size_t Microhal::measure() const {
+        std::size_t bytes = 0;
+        for (auto& p : m_prefixes) {
+            bytes += prefix_bytes(p.first) + p.second.first.memory_usage() + p.second.second.memory_usage();
+        }
+        for (auto& kw : m_keywords) { bytes += entry_bytes(kw.first); }
+        return bytes;
+    }
+
+    std::uint32_t Microhal::period() const {
+        return m_half_life == 0 ? 0 : m_epoch / m_half_life;
+    }
+
+    int Microhal::keyword_count(const Keyword& kw) const {
+        auto p = period();
+        return p > kw.period ? decay(kw.count, p - kw.period) : kw.count;
+    }
+
+    void Microhal::add_keyword(TokenRef kw) {
+        auto it = m_keywords.find(kw);
+        if (it == m_keywords.end()) {
+            m_keywords.emplace(kw.str(), Keyword{1, period()});
+            m_memory += entry_bytes(kw);
+            return;
+        }
+        auto& k = it->second;
+        k.count = keyword_count(k);
+        k.period = period();
+        if (k.count + 1 > k.count) {
+            k.count += 1;
+        }
+    }
 
-        static auto comp = [&](const Token& t1, const Token& t2) -> bool {
-            auto t1_it = m_keywords.find(t1);
-            auto t2_it = m_keywords.find(t2);
-            auto t1_val = t1_it == m_keywords.end() ? std::numeric_limits<int>::max() : t1_it->second;
-            auto t2_val = t2_it == m_keywords.end() ? std::numeric_limits<int>::max() : t2_it->second;
+    ScratchVector<const Prefix*> Microhal::get_best_prefixes(const ScratchVector<TokenRef>& tokens, TokenRef* keyword,
+                                                             const CancelToken* cancel) const {
+        // rarest keyword first; keywords that are unknown or have decayed
+        // away are tried last
+        auto rarity = [&](TokenRef t) {
+            auto it = m_keywords.find(t);
+            auto c = it == m_keywords.end() ? 0 : keyword_count(it->second);
+            return c == 0 ? std::numeric_limits<int>::max() : c;
+        };
+        auto comp = [&](TokenRef t1, TokenRef t2) -> bool {
+            auto t1_val = rarity(t1);
+            auto t2_val = rarity(t2);
             if (t1_val == t2_val) { return t1 < t2; }
             return t1_val < t2_val;
         };
 
-        std::sort(keywords.begin(), keywords.end(), comp);
+        ScratchVector<TokenRef> keywords(tokens.begin(), tokens.end());
+        {
+            StageTimer timer(m_stats, Stage::rank);
+            std::sort(keywords.begin(), keywords.end(), comp);
+        }
 
         // find the prefixes associated with the first (most uncommon) keyword
-        std::vector<Prefix> prefixes;
+        StageTimer timer(m_stats, Stage::candidates);
+        ScratchVector<const Prefix*> prefixes;
+        std::size_t visited = 0;
         for (auto& kw : keywords) {
             for (auto& p : m_prefixes) {
+                if (++visited % cancel_stride == 0) { check(cancel); }
                 if (std::find(p.first.begin(), p.first.end(), kw) != p.first.end()) {
-                    prefixes.push_back(p.first);
-                } 
+                    prefixes.push_back(&p.first);
+                }
             }
             if (prefixes.size() > 0) {
-                return prefixes;
+                if (keyword != nullptr) { *keyword = kw; }
+                break;
             }
         }
-        return std::vector<Prefix>();
+        count(m_stats, Counter::candidates, prefixes.size());
+        return prefixes;
     }
 
-    std::string Microhal::build_response(Prefix p) {
-        std::deque<Token> tokens(p.begin(), p.end());
-        auto length = m_order;
-        while (length < 100 && (tokens.front() != "" || tokens.back() != "")) {
-            if (tokens.front() != "") {
-                Prefix lp(tokens.begin(), std::next(tokens.begin(), m_order), m_order);
-                auto t = suffixes(lp).first.get();
-                tokens.push_front(t);
-                ++length;
+    std::pair<TokenRef*, TokenRef*> Microhal::walk(const Prefix& p, ScratchVector<TokenRef>& buffer, const ReplyOptions& options,
+                                                   const ScratchVector<TokenRef>* keywords, const TokenCallback* emit) const {
+        StageTimer timer(m_stats, Stage::generate);
+        // The reply grows in both directions, so it is built in the middle of
+        // a buffer with room for the length limit on either side.
+        auto room = (buffer.size() - static_cast<std::size_t>(m_order)) / 2;
+        auto first = buffer.data() + room;
+        auto last = std::copy(p.begin(), p.end(), first);
+        auto end = buffer.data() + buffer.size();
+
+        auto current = period();
+        auto next = [&](PrefixRef ref, bool backward) -> TokenRef {
+            auto it = m_prefixes.find(ref);
+            if (it == m_prefixes.end()) { return TokenRef(); }
+            return backward ? it->second.first.get(current) : it->second.second.get(current);
+        };
+
+        // Keywords are only tracked when the reply may stop once all of them
+        // are in it. keywords must be sorted.
+        ScratchVector<char> covered;
+        std::size_t uncovered = 0;
+        if (options.stop_when_covered && keywords != nullptr) {
+            covered.resize(keywords->size());
+            uncovered = keywords->size();
+        }
+        std::size_t length = 0;
+        std::size_t bytes = 0;
+        auto add = [&](TokenRef t) {
+            if (t.empty()) { return; }
+            length += options.count_words_only && ::isspace(*t.data()) ? 0 : 1;
+            bytes += t.size();
+            if (uncovered != 0) {
+                auto k = std::lower_bound(keywords->begin(), keywords->end(), t);
+                if (k != keywords->end() && *k == t && !covered[static_cast<std::size_t>(k - keywords->begin())]) {
+                    covered[static_cast<std::size_t>(k - keywords->begin())] = 1;
+                    --uncovered;
+                }
+            }
+        };
+        // false when t does not fit the limits and the reply must end
+        auto fits = [&](TokenRef t) {
+            if (t.empty()) { return true; }
+            auto l = length + (options.count_words_only && ::isspace(*t.data()) ? 0 : 1);
+            if (l > options.max_tokens || (options.max_bytes != 0 && bytes + t.size() > options.max_bytes)) { return false; }
+            add(t);
+            return true;
+        };
+        // the starting prefix is kept whatever the limits
+        for (auto it = first; it != last; ++it) { add(*it); }
+        // Each step adds a token to one side and is false once that side
+        // has ended. A token over the limits ends the whole reply.
+        bool stopped = false;
+        auto done = [&]() { return stopped || (covered.size() != 0 && uncovered == 0); };
+        auto backward = [&]() {
+            check(options.cancel);
+            if (done() || first->empty()) { return false; }
+            auto t = next(PrefixRef(first, first + m_order, m_order), true);
+            if (first == buffer.data() || !fits(t)) { stopped = true; return false; }
+            *--first = t;
+            return true;
+        };
+        auto forward = [&]() {
+            check(options.cancel);
+            if (done() || std::prev(last)->empty()) { return false; }
+            auto t = next(PrefixRef(last - m_order, last, m_order), false);
+            if (last == end || !fits(t)) { stopped = true; return false; }
+            *last++ = t;
+            return true;
+        };
+
+        if (emit == nullptr) {
+            // alternating keeps a reply cut by the limits centred on its prefix
+            while (backward() | forward()) {}
+        } else {
+            // Only the forward half can be sent as it is made, so the
+            // backward half is finished first and sent with the prefix.
+            while (backward()) {}
+            for (auto it = first; it != last; ++it) {
+                if (!it->empty()) { (*emit)(*it); }
+            }
+            while (forward()) {
+                if (!std::prev(last)->empty()) { (*emit)(*std::prev(last)); }
             }
-            if (tokens.back() != "") {
-                Prefix rp(std::prev(tokens.end(), m_order), tokens.end(), m_order);
-                auto t = suffixes(rp).second.get();
-                tokens.push_back(t);
-                ++length;
+        }
+
+        count(m_stats, Counter::generated_tokens, static_cast<std::uint64_t>(last - first));
+        return std::make_pair(first, last);
+    }
+
+    double Microhal::score(const TokenRef* first, const TokenRef* last, const ScratchVector<TokenRef>& keywords) const {
+        // MegaHAL's measure: the information, in bits, of the transitions
+        // that produced keywords of the input, damped for long replies so
+        // that length alone does not win. It is scaled by up to two for the
+        // share of keywords the reply covers. keywords must be sorted.
+        double surprise = 0;
+        std::size_t found = 0;
+        ScratchVector<char> covered(keywords.size());
+        for (auto it = first; it != last; ++it) {
+            auto k = std::lower_bound(keywords.begin(), keywords.end(), *it);
+            if (k == keywords.end() || *k != *it) { continue; }
+            covered[static_cast<std::size_t>(k - keywords.begin())] = 1;
+
+            // the map the token was drawn from, looking forward when a full
+            // prefix precedes it
+            const SuffixMap* from = nullptr;
+            if (it - first >= m_order) {
+                auto p = m_prefixes.find(PrefixRef(it - m_order, it, m_order));
+                if (p != m_prefixes.end()) { from = &p->second.second; }
+            } else if (last - it > m_order) {
+                auto p = m_prefixes.find(PrefixRef(it + 1, it + 1 + m_order, m_order));
+                if (p != m_prefixes.end()) { from = &p->second.first; }
             }
+            auto c = from == nullptr ? 0 : from->count(*it);
+            if (c == 0) { continue; }
+            surprise -= std::log2(static_cast<double>(c) / static_cast<double>(from->size()));
+            ++found;
         }
-        std::ostringstream os;
-        std::copy(tokens.begin(), tokens.end(), std::ostream_iterator<std::string>(os));
-        return os.str();
+        if (found > 8) { surprise /= std::sqrt(static_cast<double>(found - 1)); }
+        if (found > 16) { surprise /= static_cast<double>(found); }
+        auto coverage = static_cast<double>(std::count(covered.begin(), covered.end(), 1));
+        return surprise * (1.0 + coverage / static_cast<double>(std::max<std::size_t>(1, keywords.size())));
+    }
+
+    std::string Microhal::build_response(const Prefix& p, const ReplyOptions& options, const ScratchVector<TokenRef>* keywords,
+                                         const TokenCallback* emit) const {
+        ScratchVector<TokenRef> buffer(2 * reply_room(options) + static_cast<std::size_t>(m_order));
+        auto range = walk(p, buffer, options, keywords, emit);
+        return join(range.first, range.second);
     }
 
     Microhal::Microhal(int order) : m_order(order) {
     }
 
-    std::string Microhal::add(const std::string& input) {
-        auto tokens = tokenize(input);
-        auto prefixes = get_best_prefixes(tokens);
+    std::pair<double, std::string> Microhal::best_reply(const ScratchVector<const Prefix*>& prefixes,
+                                                        const ScratchVector<TokenRef>& keywords,
+                                                        const ReplyOptions& options, std::uint64_t deadline,
+                                                        std::atomic<std::uint64_t>& generated) const {
+        // Walks candidates until the deadline, or until generated reaches
+        // the candidate limit, at least one unless the limit is reached.
+        // Candidates are walked into other, which is swapped with buffer
+        // whenever it holds the new best.
+        ScratchScope scope;
+        ScratchVector<TokenRef> buffer(2 * reply_room(options) + static_cast<std::size_t>(m_order));
+        ScratchVector<TokenRef> other(buffer.size());
+        std::pair<TokenRef*, TokenRef*> best(nullptr, nullptr);
+        double best_score = 0;
+        std::uint64_t walked = 0;
+        auto limit = options.max_candidates == 0 ? std::numeric_limits<std::uint64_t>::max() : options.max_candidates;
+        while (generated.fetch_add(1, std::memory_order_relaxed) < limit) {
+            auto& p = *prefixes[static_cast<std::size_t>(random(0, prefixes.size() - 1))];
+            auto candidate = walk(p, other, options, &keywords);
+            ++walked;
+            auto s = score(candidate.first, candidate.second, keywords);
+            if (best.first == nullptr || s > best_score) {
+                best_score = s;
+                best = candidate;
+                buffer.swap(other);
+            }
+            if (trace_clock() >= deadline) { break; }
+        }
+        count(m_stats, Counter::replies, walked);
+        if (best.first == nullptr) { return std::make_pair(-1.0, std::string()); }
+        return std::make_pair(best_score, join(best.first, best.second));
+    }
+
+    std::string Microhal::reply(const ScratchVector<TokenRef>& tokens, const ReplyOptions& options, RequestInfo& info,
+                                const TokenCallback* emit) const {
+        auto prefixes = get_best_prefixes(tokens, &info.keyword, options.cancel);
+        info.candidates = prefixes.size();
+        if (prefixes.empty()) {
+            std::string nope = "Nope, nothing";
+            if (emit != nullptr) { (*emit)(TokenRef(nope)); }
+            return nope;
+        }
+
+        ScratchVector<TokenRef> keywords;
+        for (auto& t : tokens) {
+            if (!::isspace(*t.data())) { keywords.push_back(t); }
+        }
+        std::sort(keywords.begin(), keywords.end());
+        keywords.erase(std::unique(keywords.begin(), keywords.end()), keywords.end());
 
-        std::string ret = "Nope, nothing";
-        if (!prefixes.empty()) {
-            auto i = random(0, prefixes.size() - 1);
-            ret = build_response(prefixes[i]);
+        if (options.budget.count() == 0) {
+            count(m_stats, Counter::replies, 1);
+            return build_response(*prefixes[static_cast<std::size_t>(random(0, prefixes.size() - 1))], options, &keywords, emit);
         }
+        // a budgeted reply is only known once the budget is spent
+        auto best = budgeted_reply(prefixes, keywords, options, info.start + static_cast<std::uint64_t>(options.budget.count()));
+        if (emit != nullptr && !best.empty()) { (*emit)(TokenRef(best)); }
+        return best;
+    }
+
+    std::string Microhal::budgeted_reply(const ScratchVector<const Prefix*>& prefixes, const ScratchVector<TokenRef>& keywords,
+                                         const ReplyOptions& options, std::uint64_t deadline) const {
+        std::atomic<std::uint64_t> generated(0);
+        if (options.pool == nullptr) { return best_reply(prefixes, keywords, options, deadline, generated).second; }
+
+        // The brain is only read here, so every task walks its own
+        // candidates and the best of their bests wins. A task that only
+        // starts after the deadline, queued behind other replies, returns at
+        // once; the caller's own part 0 still makes one candidate.
+        auto tasks = options.pool->size();
+        if (options.pool_tasks != 0) { tasks = std::min(tasks, options.pool_tasks); }
+        std::vector<std::pair<double, std::string>> bests(tasks + 1, std::make_pair(-1.0, std::string()));
+        options.pool->parallel_for(bests.size(), [&](std::size_t i) {
+            if (i != 0 && trace_clock() >= deadline) { return; }
+            bests[i] = best_reply(prefixes, keywords, options, deadline, generated);
+        });
+        return std::max_element(bests.begin(), bests.end(), [](const std::pair<double, std::string>& a, const std::pair<double, std::string>& b) {
+            return a.first < b.first;
+        })->second;
+    }
 
-        auto start = tokens.cbegin();
-        auto stop = std::next(start, m_order);
-        stop = stop < tokens.end() ? stop : tokens.end();
-        while (start == tokens.begin() || stop <= tokens.end()) {
-            Prefix p(start, stop, m_order); 
-            if (start > tokens.begin()) { suffixes(p).first.add(*std::prev(start)); }
-            else                        { suffixes(p).first.add(""); }
-            if (stop < tokens.end())    { suffixes(p).second.add(*stop); }
-            else                        { suffixes(p).second.add(""); }
-            std::advance(start, 1);
-            std::advance(stop, 1);
+    void Microhal::learn(const ScratchVector<TokenRef>& tokens) {
+        StageTimer timer(m_stats, Stage::learn);
+        count(m_stats, Counter::learned_tokens, tokens.size());
+        auto first = tokens.data();
+        auto last = first + tokens.size();
+        auto stop = first + std::min(tokens.size(), static_cast<size_t>(m_order));
+        for (auto start = first; ; ++start, ++stop) {
+            PrefixRef p(start, stop, m_order);
+            auto& s = suffixes(p);
+            age_prefix(p, s);
+            auto before = start > first ? *std::prev(start) : TokenRef();
+            auto after = stop < last ? *stop : TokenRef();
+            m_memory += s.first.add(before) + s.second.add(after);
+            if (stop == last)  { break; }
         }
 
         for (auto& kw : tokens) {
             add_keyword(kw);
         }
+
+        if (m_half_life != 0) {
+            ++m_epoch;
+        }
+        if (m_memory_limit != 0 || m_half_life != 0) {
+            auto over = m_memory_limit != 0 && m_memory > m_memory_limit;
+            evict(m_evicting || over ? eviction_steps : aging_steps * tokens.size());
+        }
+    }
+
+    void Microhal::log_request(const std::string& input, const std::string& reply, const RequestInfo& info) const {
+        auto ns = trace_clock() - info.start;
+        if (!m_slow_log.slow(ns)) { return; }
+        m_slow_log.record(SlowRequest{
+            std::time(nullptr), input, info.keyword.str(), info.candidates, reply.size(), ns, info.profile.times()
+        });
+    }
+
+    std::string Microhal::reply(const std::string& input, const ReplyOptions& options) const {
+        RequestInfo info;
+        ScratchScope scope;
+        std::string ret;
+        {
+            StageTimer timer(m_stats, Stage::request);
+            ScratchVector<TokenRef> tokens;
+            {
+                StageTimer t(m_stats, Stage::tokenize);
+                tokenize(input, tokens);
+            }
+            ret = reply(tokens, options, info);
+        }
+        log_request(input, ret, info);
         return ret;
     }
 
+    std::string Microhal::stream_reply(const std::string& input, const TokenCallback& emit, const ReplyOptions& options) const {
+        RequestInfo info;
+        ScratchScope scope;
+        std::string ret;
+        {
+            StageTimer timer(m_stats, Stage::request);
+            ScratchVector<TokenRef> tokens;
+            {
+                StageTimer t(m_stats, Stage::tokenize);
+                tokenize(input, tokens);
+            }
+            bool first = true;
+            TokenCallback timed = [&](TokenRef t) {
+                if (first) {
+                    record(m_stats, Stage::first_token, trace_clock() - info.start);
+                    first = false;
+                }
+                emit(t);
+            };
+            ret = reply(tokens, options, info, &timed);
+        }
+        log_request(input, ret, info);
+        return ret;
+    }
+
+    void Microhal::learn(const std::string& input) {
+        StageTimer timer(m_stats, Stage::request);
+        ScratchScope scope;
+        ScratchVector<TokenRef> tokens;
+        {
+            StageTimer t(m_stats, Stage::tokenize);
+            tokenize(input, tokens);
+        }
+        learn(tokens);
+    }
+
+    std::string Microhal::add(const std::string& input, const ReplyOptions& options) {
+        RequestInfo info;
+        ScratchScope scope;
+        std::string ret;
+        {
+            StageTimer timer(m_stats, Stage::request);
+            ScratchVector<TokenRef> tokens;
+            {
+                StageTimer t(m_stats, Stage::tokenize);
+                tokenize(input, tokens);
+            }
+            try {
+                ret = reply(tokens, options, info);
+            } catch (const ReplyCancelled&) {
+                if (options.learn_on_cancel) { learn(tokens); }
+                throw;
+            }
+            learn(tokens);
+        }
+        log_request(input, ret, info);
+        return ret;
+    }
+
+    std::size_t Microhal::prefix_count() const {
+        return m_prefixes.size();
+    }
+
+    std::size_t Microhal::token_count() const {
+        return m_keywords.size();
+    }
+
+    const Stats& Microhal::stats() const {
+        return m_stats;
+    }
+
+    void Microhal::reset_stats() {
+        m_stats.reset();
+    }
+
+    SlowLog& Microhal::slow_log() {
+        return m_slow_log;
+    }
+
+    const SlowLog& Microhal::slow_log() const {
+        return m_slow_log;
+    }
+
+    void Microhal::set_memory_limit(std::size_t bytes) {
+        m_memory_limit = bytes;
+    }
+
+    std::size_t Microhal::memory_limit() const {
+        return m_memory_limit;
+    }
+
+    std::size_t Microhal::memory_usage() const {
+        return m_memory;
+    }
+
+    std::size_t Microhal::evict(std::size_t steps) {
+        // Visits at most steps prefixes and keywords, resuming where the
+        // previous call stopped. Visited entries are aged, and dropped once
+        // their counts have decayed to zero.
+        //
+        // Eviction runs in bursts from the first time the memory limit is
+        // exceeded until usage is back under 90% of it. During a burst,
+        // visited entries seen no more than m_evict_threshold times are
+        // evicted, and a full pass that leaves the brain over budget doubles
+        // the threshold.
+        if (!m_evicting && m_memory_limit != 0 && m_memory > m_memory_limit) {
+            m_evicting = true;
+            m_evict_threshold = 1;
+            m_evict_visited = 0;
+        }
+        if (!m_evicting && m_half_life == 0) { return 0; }
+
+        auto low_water = m_memory_limit - m_memory_limit / 10;
+        auto current = period();
+        auto before = m_memory;
+        auto p = m_prefixes.lower_bound(m_prefix_cursor);
+        auto k = m_keywords.lower_bound(m_keyword_cursor);
+        for (std::size_t i = 0; i < steps; ++i) {
+            if (m_evicting && m_memory <= low_water) {
+                m_evicting = false;
+                if (m_half_life == 0) { break; }
+            }
+            if (p == m_prefixes.end()) { p = m_prefixes.begin(); }
+            if (p != m_prefixes.end()) {
+                auto& s = p->second;
+                age_prefix(p->first, s);
+                if ((s.first.empty() && s.second.empty()) || (m_evicting && s.second.size() <= m_evict_threshold)) {
+                    p = erase_prefix(p);
+                } else {
+                    ++p;
+                }
+            }
+            if (k == m_keywords.end()) { k = m_keywords.begin(); }
+            if (k != m_keywords.end()) {
+                auto& kw = k->second;
+                kw.count = keyword_count(kw);
+                kw.period = current;
+                if (kw.count == 0 || (m_evicting && static_cast<std::size_t>(kw.count) <= m_evict_threshold)) {
+                    m_memory -= entry_bytes(k->first);
+                    k = m_keywords.erase(k);
+                } else {
+                    ++k;
+                }
+            }
+            if (m_evicting && ++m_evict_visited >= std::max(m_prefixes.size(), m_keywords.size())) {
+                m_evict_threshold *= 2;
+                m_evict_visited = 0;
+            }
+        }
+        if (m_evicting && m_memory <= low_water) { m_evicting = false; }
+
+        m_prefix_cursor = p == m_prefixes.end() ? Prefix() : p->first;
+        m_keyword_cursor = k == m_keywords.end() ? std::string() : k->first;
+        return before - m_memory;
+    }
+
+    void Microhal::set_half_life(std::uint32_t epochs) {
+        m_half_life = epochs;
+    }
+
+    std::uint32_t Microhal::half_life() const {
+        return m_half_life;
+    }
+
+    void Microhal::advance_epoch(std::uint32_t epochs) {
+        m_epoch += epochs;
+    }
+
     std::ostream& operator<<(std::ostream& os, const microhal::Microhal& m) {
         return os << json(m.m_prefixes);
     }
@@ -203,12 +964,26 @@ namespace microhal {
     }
 
     void to_json(json& j, const SuffixMap& sm) {
-        j = json{sm.m_suffixes, sm.m_total};
+        json suffixes = json::object();
+        for (auto s : sm) { suffixes[s.first.str()] = s.second; }
+        j = json{suffixes, sm.m_total, sm.m_period};
     }
 
     void from_json(const json& j, SuffixMap& sm) {
-        sm.m_suffixes = j[0].get<std::map<std::string, int>>();
-        sm.m_total = j[1].get<size_t>();
+        // Objects iterate in key order, which is the order suffixes are kept in.
+        auto& suffixes = j[0];
+        std::uint32_t max = 0;
+        for (auto it = suffixes.begin(); it != suffixes.end(); ++it) { max = std::max(max, it.value().get<std::uint32_t>()); }
+        sm = SuffixMap();
+        sm.fit(max);
+        sm.m_tokens.reserve(suffixes.size());
+        sm.m_counts.resize(suffixes.size() * sm.m_width);
+        for (auto it = suffixes.begin(); it != suffixes.end(); ++it) {
+            sm.m_tokens.push_back(it.key());
+            sm.set_count(sm.m_tokens.size() - 1, it.value().get<std::uint32_t>());
+        }
+        sm.m_total = j[1].get<std::uint32_t>();
+        sm.m_period = j.size() > 2 ? j[2].get<std::uint32_t>() : 0;
     }
 
     void to_json(json& j, const std::pair<microhal::SuffixMap, microhal::SuffixMap>& p) {
@@ -222,13 +997,13 @@ namespace microhal {
         p1 = p2;
     }
 
-    void to_json(json& j, const std::map<microhal::Prefix, std::pair<microhal::SuffixMap, microhal::SuffixMap>>& m) {
+    void to_json(json& j, const PrefixMap& m) {
         for (auto& p : m) {
             j.push_back({p.first, json(p.second)});
         }
     }
 
-    void from_json(const json& j, std::map<microhal::Prefix, std::pair<microhal::SuffixMap, microhal::SuffixMap>>& m) {
+    void from_json(const json& j, PrefixMap& m) {
         for (auto& p : j) {
             auto prefix = p[0].get<microhal::Prefix>();
             auto suffix_map = p[1].get<std::pair<microhal::SuffixMap, microhal::SuffixMap>>();
@@ -237,34 +1012,33 @@ namespace microhal {
     }
 
     void to_json(json& j, const microhal::Microhal& m) {
-        j = json{m.m_order, m.m_keywords, m.m_prefixes};
+        TraceSpan span("save");
+        // keywords are stored with their counts aged to the current period
+        std::map<std::string, int> keywords;
+        for (auto& kw : m.m_keywords) {
+            auto count = m.keyword_count(kw.second);
+            if (count != 0) { keywords.emplace(kw.first, count); }
+        }
+        j = json{m.m_order, keywords, m.m_prefixes, {m.m_epoch, m.m_half_life}};
     }
 
     void from_json(const json& j, microhal::Microhal& m) {
+        TraceSpan span("load");
         m.m_order = j[0].get<int>();
-        m.m_keywords = j[1].get<std::map<std::string, int>>();
-        m.m_prefixes = j[2].get<std::map<microhal::Prefix, std::pair<microhal::SuffixMap, microhal::SuffixMap>>>();
-    }
-
-}
-
-int main() {
-    microhal::Microhal m(4);
-    std::string in;
-    std::cout << "HEJ!!!!" << std::endl;
-    while (std::getline(std::cin, in)) {
-        if (in == "\\quit" || in == "\\exit") { break; }
-        else if (in == "\\save") {
-            std::ofstream o("db.json");
-            o << json(m) << std::endl;
-        }
-        else if (in == "\\load") {
-            std::ifstream i("db.json");
-            json j;
-            i >> j;
-            m = j.get<microhal::Microhal>();
-        }
-        else { std::cout << m.add(in) << std::endl; }
+        if (j.size() > 3) {
+            m.m_epoch = j[3][0].get<std::uint32_t>();
+            m.m_half_life = j[3][1].get<std::uint32_t>();
+        }
+        m.m_keywords.clear();
+        for (auto& kw : j[1].get<std::map<std::string, int>>()) {
+            m.m_keywords.emplace(kw.first, Keyword{kw.second, m.period()});
+        }
+        m.m_prefixes.clear();
+        from_json(j[2], m.m_prefixes);
+        m.m_memory = m.measure();
+        m.m_evicting = false;
+        m.m_prefix_cursor = Prefix();
+        m.m_keyword_cursor.clear();
     }
 
 }
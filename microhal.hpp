@@ -1,19 +1,71 @@
 #ifndef MICROHAL_H
 #define MICROHAL_H
 
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
 #include <map>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
+#include "arena.hpp"
+// json.hpp's value union trips -Wmaybe-uninitialized at -O2
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
 #include "json.hpp"
+#pragma GCC diagnostic pop
+#include "stats.hpp"
 using json = nlohmann::json;
 
 namespace microhal {
     using Token = std::string;
 
+    // Non-owning view of a token. Refs point either into the input string or
+    // into keys owned by the brain, and never outlive the current request.
+    class TokenRef {
+        const char* m_data;
+        std::size_t m_size;
+
+    public:
+        TokenRef();
+        TokenRef(const char* data, std::size_t size);
+        TokenRef(const Token& t);
+
+        const char* data() const;
+        std::size_t size() const;
+        bool empty() const;
+        Token str() const;
+
+        friend int compare(TokenRef a, TokenRef b);
+        friend std::ostream& operator<<(std::ostream& os, TokenRef t);
+    };
+
+    bool operator<(TokenRef a, TokenRef b);
+    bool operator==(TokenRef a, TokenRef b);
+    bool operator!=(TokenRef a, TokenRef b);
+
     std::vector<Token> tokenize(const std::string& s);
+    void tokenize(const std::string& s, ScratchVector<TokenRef>& tokens);
     int random(int min, int max);
 
+    // A count after the given number of half-lives have passed.
+    int decay(int count, std::uint32_t periods);
+
+    // View of order consecutive tokens, used to look up prefixes without
+    // building an owning Prefix.
+    class PrefixRef {
+        const TokenRef* m_begin;
+        const TokenRef* m_end;
+
+    public:
+        PrefixRef(const TokenRef* start, const TokenRef* stop, int order);
+
+        const TokenRef* begin() const;
+        const TokenRef* end() const;
+    };
+
     class Prefix {
     public:
         using container_type = std::vector<Token>;
@@ -28,6 +80,7 @@ namespace microhal {
     public:
         template<typename InputIterator>
         Prefix(InputIterator start, InputIterator stop, int order);
+        explicit Prefix(PrefixRef ref);
         Prefix() = default;
 
         const_iterator begin() const;
@@ -40,35 +93,232 @@ namespace microhal {
         friend std::ostream& operator<<(std::ostream& os, const Prefix& p);
     };
 
+    bool operator<(const Prefix& p, PrefixRef r);
+    bool operator<(PrefixRef r, const Prefix& p);
+
+    // Counts are decayed lazily: m_period is the decay period the counts
+    // were last aged to, and age() catches them up when the map is written.
+    //
+    // Suffixes are kept sorted in a vector, with their counts packed in a
+    // parallel buffer of m_width bytes each. Most counts are 1, so a map
+    // starts with one byte per count and is promoted to two, then four, the
+    // first time a count outgrows its width. Counts never narrow again. The
+    // buffer is a string so that the counts of small maps need no
+    // allocation of their own.
     class SuffixMap {
-        std::map<std::string, int>  m_suffixes;
-        size_t                      m_total;
+        std::vector<std::string> m_tokens;
+        std::string              m_counts;
+        std::uint32_t            m_total;
+        std::uint32_t            m_period;
+        std::uint8_t             m_width;
+
+        std::size_t find(TokenRef suffix) const;
+        std::uint32_t count_at(std::size_t i) const;
+        void set_count(std::size_t i, std::uint32_t count);
+        std::size_t fit(std::uint32_t count);
+        std::size_t entry_bytes(std::size_t i) const;
+
     public:
+        // Iterates over (suffix, count) pairs in suffix order.
+        class const_iterator {
+            const SuffixMap* m_map;
+            std::size_t      m_index;
+
+        public:
+            using value_type = std::pair<TokenRef, int>;
+
+            const_iterator(const SuffixMap* map, std::size_t index) : m_map(map), m_index(index) {}
+            value_type operator*() const {
+                return value_type(m_map->m_tokens[m_index], static_cast<int>(m_map->count_at(m_index)));
+            }
+            const_iterator& operator++() { ++m_index; return *this; }
+            bool operator==(const const_iterator& other) const { return m_index == other.m_index; }
+            bool operator!=(const const_iterator& other) const { return m_index != other.m_index; }
+        };
+
         SuffixMap();
 
         size_t size() const;
-        void add(const std::string& suffix);
-        std::string get() const;
+        bool empty() const;
+        std::size_t entry_count() const;
+        // bytes per count, 1, 2 or 4
+        std::size_t width() const;
+        std::uint32_t period() const;
+        const_iterator begin() const;
+        const_iterator end() const;
+        // add, remove and age return the change in memory_usage()
+        std::size_t add(TokenRef suffix);
+        int count(TokenRef suffix) const;
+        std::size_t remove(TokenRef suffix);
+        std::size_t age(std::uint32_t period);
+        TokenRef get(std::uint32_t period = 0) const;
+        // estimated heap bytes of the entries
+        std::size_t memory_usage() const;
 
         friend void to_json(json& j, const SuffixMap& sm);
         friend void from_json(const json& j, SuffixMap& sm);
         friend std::ostream& operator<<(std::ostream& os, const SuffixMap& m);
     };
 
+    struct Keyword {
+        int           count;
+        std::uint32_t period;
+    };
+
+    // Estimated heap cost of keyword entries and prefixes, as used for
+    // memory accounting.
+    std::size_t entry_bytes(TokenRef t);
+    std::size_t prefix_bytes(const Prefix& p);
+    std::size_t prefix_bytes(PrefixRef p);
+
+    class ThreadPool;
+
+    // Lets another thread abandon a reply in flight. Replies check it
+    // between tokens and candidates, and every few thousand prefixes of the
+    // candidate scan, then throw ReplyCancelled.
+    class CancelToken {
+        std::atomic<bool> m_cancelled;
+
+    public:
+        CancelToken() : m_cancelled(false) {}
+        void cancel() { m_cancelled.store(true, std::memory_order_relaxed); }
+        bool cancelled() const { return m_cancelled.load(std::memory_order_relaxed); }
+    };
+
+    class ReplyCancelled : public std::runtime_error {
+    public:
+        ReplyCancelled() : std::runtime_error("reply cancelled") {}
+    };
+
+    // receives a reply one piece at a time, in order
+    using TokenCallback = std::function<void(TokenRef)>;
+
+    struct ReplyOptions {
+        // Keeps generating candidate replies until budget has passed since
+        // the request started and returns the best scoring one. Zero makes
+        // a single candidate.
+        std::chrono::nanoseconds budget = std::chrono::nanoseconds(0);
+        // stops earlier after this many candidates, 0 for no limit
+        std::size_t              max_candidates = 0;
+        // generates candidates on every worker of pool as well, if set
+        ThreadPool*              pool = nullptr;
+        // most tasks one reply queues on pool, 0 for one per worker
+        std::size_t              pool_tasks = 0;
+        // Most tokens in a reply, counting its starting prefix. A reply
+        // stops before the token that would exceed either limit; max_bytes
+        // 0 means no byte limit.
+        std::size_t              max_tokens = 100;
+        std::size_t              max_bytes = 0;
+        // count only word tokens towards max_tokens, not the whitespace
+        bool                     count_words_only = false;
+        // stops a reply as soon as it holds every keyword of the input
+        bool                     stop_when_covered = false;
+        // abandons the reply once cancelled, if set
+        const CancelToken*       cancel = nullptr;
+        // whether add() still learns the input of a cancelled reply
+        bool                     learn_on_cancel = true;
+    };
+
+    class FrozenMicrohal;
+    struct BrainReport;
+    struct BenchmarkAccess;
+
+    using PrefixMap = std::map<Prefix, std::pair<SuffixMap, SuffixMap>, std::less<>>;
+
     class Microhal {
-        std::map<Prefix, std::pair<SuffixMap, SuffixMap>> m_prefixes;
-        std::map<std::string, int>                        m_keywords;
+        PrefixMap                                  m_prefixes;
+        std::map<std::string, Keyword, std::less<>> m_keywords;
         int m_order;
 
-        auto& suffixes(const Prefix& p);
-        void add_keyword(const std::string& kw);
-        auto get_best_prefixes(std::vector<Token> keywords) const;
-        std::string build_response(Prefix p);
+        // Counts halve every m_half_life epochs (0 disables decay). An epoch
+        // passes per learned message and on advance_epoch().
+        std::uint32_t m_epoch = 0;
+        std::uint32_t m_half_life = 0;
+
+        // Estimated heap usage and the eviction state used to keep it under
+        // m_memory_limit (0 means unlimited).
+        std::size_t m_memory = 0;
+        std::size_t m_memory_limit = 0;
+        std::size_t m_evict_threshold = 1;
+        std::size_t m_evict_visited = 0;
+        bool        m_evicting = false;
+        Prefix      m_prefix_cursor;
+        std::string m_keyword_cursor;
+
+        mutable Stats   m_stats;
+        mutable SlowLog m_slow_log;
+
+        // What a request did, for the slow log.
+        struct RequestInfo {
+            std::uint64_t start = trace_clock();
+            StageProfile  profile;
+            TokenRef      keyword;
+            std::size_t   candidates = 0;
+        };
+
+        std::pair<SuffixMap, SuffixMap>& suffixes(PrefixRef p);
+        // P is Prefix or PrefixRef
+        template<typename P>
+        void unlink(const P& prefix, const std::pair<SuffixMap, SuffixMap>& s, std::uint32_t period, bool all);
+        template<typename P>
+        void age_prefix(const P& prefix, std::pair<SuffixMap, SuffixMap>& s);
+        PrefixMap::iterator erase_prefix(PrefixMap::iterator it);
+        std::uint32_t period() const;
+        int keyword_count(const Keyword& kw) const;
+        std::size_t measure() const;
+        void add_keyword(TokenRef kw);
+        ScratchVector<const Prefix*> get_best_prefixes(const ScratchVector<TokenRef>& tokens, TokenRef* keyword = nullptr,
+                                                       const CancelToken* cancel = nullptr) const;
+        std::pair<TokenRef*, TokenRef*> walk(const Prefix& p, ScratchVector<TokenRef>& buffer, const ReplyOptions& options,
+                                             const ScratchVector<TokenRef>* keywords = nullptr,
+                                             const TokenCallback* emit = nullptr) const;
+        double score(const TokenRef* first, const TokenRef* last, const ScratchVector<TokenRef>& keywords) const;
+        std::pair<double, std::string> best_reply(const ScratchVector<const Prefix*>& prefixes,
+                                                  const ScratchVector<TokenRef>& keywords,
+                                                  const ReplyOptions& options, std::uint64_t deadline,
+                                                  std::atomic<std::uint64_t>& generated) const;
+        std::string build_response(const Prefix& p, const ReplyOptions& options = ReplyOptions(),
+                                   const ScratchVector<TokenRef>* keywords = nullptr,
+                                   const TokenCallback* emit = nullptr) const;
+        std::string budgeted_reply(const ScratchVector<const Prefix*>& prefixes, const ScratchVector<TokenRef>& keywords,
+                                   const ReplyOptions& options, std::uint64_t deadline) const;
+        std::string reply(const ScratchVector<TokenRef>& tokens, const ReplyOptions& options, RequestInfo& info,
+                          const TokenCallback* emit = nullptr) const;
+        void log_request(const std::string& input, const std::string& reply, const RequestInfo& info) const;
+        void learn(const ScratchVector<TokenRef>& tokens);
 
     public:
         Microhal(int order);
         Microhal() = default;
-        std::string add(const std::string& input);
+        std::string add(const std::string& input, const ReplyOptions& options = ReplyOptions());
+        std::string reply(const std::string& input, const ReplyOptions& options = ReplyOptions()) const;
+        // Sends the reply to emit as it is made and returns it whole. Without
+        // a budget the backward half comes first, in one piece with the
+        // starting prefix, then every following token on its own. A budgeted
+        // reply comes in one piece once the budget is spent.
+        std::string stream_reply(const std::string& input, const TokenCallback& emit,
+                                 const ReplyOptions& options = ReplyOptions()) const;
+        void learn(const std::string& input);
+        FrozenMicrohal freeze() const;
+        BrainReport analyze(std::size_t threads = 0, std::size_t top = 10) const;
+        std::size_t prefix_count() const;
+        std::size_t token_count() const;
+        const Stats& stats() const;
+        void reset_stats();
+        SlowLog& slow_log();
+        const SlowLog& slow_log() const;
+
+        void set_memory_limit(std::size_t bytes);
+        std::size_t memory_limit() const;
+        std::size_t memory_usage() const;
+        std::size_t evict(std::size_t steps);
+
+        void set_half_life(std::uint32_t epochs);
+        std::uint32_t half_life() const;
+        void advance_epoch(std::uint32_t epochs = 1);
+
+        friend class FrozenMicrohal;
+        friend struct BenchmarkAccess;
 
         friend void to_json(json& j, const Microhal& m);
         friend void from_json(const json& j, Microhal& m);
@@ -0,0 +1,126 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+
+#include "mphf.hpp"
+
+namespace microhal {
+    namespace {
+        __extension__ typedef unsigned __int128 uint128;
+
+        // Maps a hash onto [0, n) with a multiply instead of a division.
+        std::uint64_t reduce(std::uint64_t h, std::uint64_t n) {
+            return static_cast<std::uint64_t>((static_cast<uint128>(h) * n) >> 64);
+        }
+    }
+
+    std::uint64_t hash64(std::uint64_t x, std::uint64_t seed) {
+        x ^= seed * 0x9e3779b97f4a7c15ULL + 0x632be59bd9b4e019ULL;
+        x ^= x >> 33;
+        x *= 0xff51afd7ed558ccdULL;
+        x ^= x >> 33;
+        x *= 0xc4ceb9fe1a85ec53ULL;
+        x ^= x >> 33;
+        return x;
+    }
+
+    constexpr std::size_t PerfectHash::block_words;
+    constexpr std::uint64_t PerfectHash::block_bits;
+
+    PerfectHash::PerfectHash() : m_level_offsets(1, 0), m_size(0) {
+    }
+
+    PerfectHash::PerfectHash(std::vector<std::uint64_t> keys, double gamma)
+    : m_level_offsets(1, 0), m_size(keys.size()) {
+        const std::size_t max_levels = 32;
+        std::vector<std::uint64_t> bits;
+        std::vector<std::uint64_t> next;
+        while (!keys.empty() && levels() < max_levels) {
+            auto level = levels();
+            auto words = std::max<std::size_t>(1, static_cast<std::size_t>(std::ceil(gamma * static_cast<double>(keys.size()) / 64)));
+            auto n = static_cast<std::uint64_t>(words) * 64;
+
+            std::vector<std::uint64_t> seen(words, 0);
+            std::vector<std::uint64_t> collide(words, 0);
+            for (auto k : keys) {
+                auto pos = reduce(hash64(k, level), n);
+                auto bit = std::uint64_t(1) << (pos % 64);
+                if (seen[pos / 64] & bit) { collide[pos / 64] |= bit; }
+                else                      { seen[pos / 64] |= bit; }
+            }
+            next.clear();
+            for (auto k : keys) {
+                auto pos = reduce(hash64(k, level), n);
+                if (collide[pos / 64] & (std::uint64_t(1) << (pos % 64))) { next.push_back(k); }
+            }
+            for (std::size_t w = 0; w < words; ++w) {
+                bits.push_back(seen[w] & ~collide[w]);
+            }
+            m_level_offsets.push_back(m_level_offsets.back() + n);
+            keys.swap(next);
+        }
+
+        auto count = (bits.size() + block_bits / 64 - 1) / (block_bits / 64);
+        m_blocks.assign(count * block_words, 0);
+        auto out = m_blocks.data();
+        std::uint64_t rank = 0;
+        for (std::size_t b = 0; b < count; ++b) {
+            out[b * block_words] = rank;
+            for (std::size_t w = 0; w < block_words - 1; ++w) {
+                auto i = b * (block_words - 1) + w;
+                auto word = i < bits.size() ? bits[i] : 0;
+                out[b * block_words + 1 + w] = word;
+                rank += static_cast<std::uint64_t>(__builtin_popcountll(word));
+            }
+        }
+
+        for (auto k : keys) {
+            m_fallback.emplace(k, static_cast<std::size_t>(rank) + m_fallback.size());
+        }
+        if (rank + m_fallback.size() != m_size) {
+            throw std::invalid_argument("PerfectHash: keys must be distinct");
+        }
+    }
+
+    std::size_t PerfectHash::operator()(std::uint64_t key) const {
+        auto data = m_blocks.data();
+        for (std::size_t level = 0; level < levels(); ++level) {
+            auto n = m_level_offsets[level + 1] - m_level_offsets[level];
+            auto pos = m_level_offsets[level] + reduce(hash64(key, level), n);
+            auto block = data + (pos / block_bits) * block_words;
+            auto word = static_cast<std::size_t>((pos % block_bits) / 64);
+            auto bit = pos % 64;
+            if (block[1 + word] & (std::uint64_t(1) << bit)) {
+                auto rank = block[0];
+                for (std::size_t w = 0; w < word; ++w) {
+                    rank += static_cast<std::uint64_t>(__builtin_popcountll(block[1 + w]));
+                }
+                rank += static_cast<std::uint64_t>(__builtin_popcountll(block[1 + word] & ((std::uint64_t(1) << bit) - 1)));
+                return static_cast<std::size_t>(rank);
+            }
+        }
+        auto it = m_fallback.find(key);
+        return it == m_fallback.end() ? m_size : it->second;
+    }
+
+    void PerfectHash::prefetch(std::uint64_t key) const {
+        if (levels() == 0) { return; }
+        auto pos = reduce(hash64(key, 0), m_level_offsets[1]);
+        __builtin_prefetch(m_blocks.data() + (pos / block_bits) * block_words);
+    }
+
+    std::size_t PerfectHash::size() const {
+        return m_size;
+    }
+
+    std::size_t PerfectHash::levels() const {
+        return m_level_offsets.size() - 1;
+    }
+
+    std::size_t PerfectHash::memory_usage() const {
+        return m_blocks.capacity() * sizeof(std::uint64_t)
+            + m_level_offsets.capacity() * sizeof(std::uint64_t)
+            + m_fallback.size() * (sizeof(std::uint64_t) + sizeof(std::size_t) + 2 * sizeof(void*));
+    }
+}
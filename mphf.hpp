@@ -0,0 +1,74 @@
+#ifndef MICROHAL_MPHF_H
+#define MICROHAL_MPHF_H
+
+#include <cstdint>
+#include <new>
+#include <unordered_map>
+#include <vector>
+
+namespace microhal {
+
+    // Allocates on cache-line boundaries. The pointer returned by operator
+    // new is kept just before the aligned block.
+    template<typename T>
+    class CacheAlignedAllocator {
+    public:
+        using value_type = T;
+
+        CacheAlignedAllocator() = default;
+        template<typename U>
+        CacheAlignedAllocator(const CacheAlignedAllocator<U>&) {}
+
+        T* allocate(std::size_t n) {
+            auto raw = static_cast<char*>(::operator new(n * sizeof(T) + sizeof(void*) + 63));
+            auto base = reinterpret_cast<std::uintptr_t>(raw + sizeof(void*));
+            auto aligned = reinterpret_cast<void**>((base + 63) & ~std::uintptr_t(63));
+            aligned[-1] = raw;
+            return reinterpret_cast<T*>(aligned);
+        }
+        void deallocate(T* p, std::size_t) {
+            ::operator delete(reinterpret_cast<void**>(p)[-1]);
+        }
+
+        template<typename U>
+        bool operator==(const CacheAlignedAllocator<U>&) const { return true; }
+        template<typename U>
+        bool operator!=(const CacheAlignedAllocator<U>&) const { return false; }
+    };
+
+    std::uint64_t hash64(std::uint64_t x, std::uint64_t seed);
+
+    // Minimal perfect hash over a set of distinct 64-bit keys, built in the
+    // style of BBHash: each level is a bit array holding the keys that did
+    // not collide with another key there, and the rest move on to the next
+    // level. A key's slot is the rank of its bit across all levels. Bits are
+    // packed into cache-line blocks that carry their own rank, so each probed
+    // level costs one cache line.
+    //
+    // Keys outside the set map to an arbitrary slot or to size(); callers
+    // must check the slot, e.g. with a fingerprint.
+    class PerfectHash {
+        // A block is one rank word followed by seven words of bits.
+        static constexpr std::size_t block_words = 8;
+        static constexpr std::uint64_t block_bits = 7 * 64;
+
+        std::vector<std::uint64_t, CacheAlignedAllocator<std::uint64_t>> m_blocks;
+        std::vector<std::uint64_t>                     m_level_offsets;
+        std::unordered_map<std::uint64_t, std::size_t> m_fallback;
+        std::size_t                                    m_size;
+
+    public:
+        PerfectHash();
+        explicit PerfectHash(std::vector<std::uint64_t> keys, double gamma = 2.0);
+
+        std::size_t operator()(std::uint64_t key) const;
+        // Starts loading the first level's block for key, where most keys
+        // are found, so a later lookup of key does not wait on memory.
+        void prefetch(std::uint64_t key) const;
+        std::size_t size() const;
+        std::size_t levels() const;
+        std::size_t memory_usage() const;
+    };
+}
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef MICROHAL_MPSC_H
+#define MICROHAL_MPSC_H
+
+#include <atomic>
+#include <memory>
+#include <utility>
+
+namespace microhal {
+
+    // Unbounded lock-free queue for many producers and a single consumer,
+    // after Vyukov's intrusive MPSC queue. A push is one exchange and one
+    // store. pop() may briefly report empty while a push is in progress.
+    template<typename T>
+    class MpscQueue {
+        struct Node {
+            std::atomic<Node*> next;
+            T                  value;
+
+            Node() : next(nullptr), value() {}
+            explicit Node(T v) : next(nullptr), value(std::move(v)) {}
+        };
+
+        std::atomic<Node*> m_head;
+        Node*              m_tail;
+        Node               m_stub;
+
+        void push(Node* n) {
+            n->next.store(nullptr, std::memory_order_relaxed);
+            auto prev = m_head.exchange(n, std::memory_order_acq_rel);
+            prev->next.store(n, std::memory_order_release);
+        }
+
+    public:
+        MpscQueue() : m_head(&m_stub), m_tail(&m_stub) {}
+
+        ~MpscQueue() {
+            T discard;
+            while (pop(discard)) {}
+        }
+
+        MpscQueue(const MpscQueue&) = delete;
+        MpscQueue& operator=(const MpscQueue&) = delete;
+
+        // Safe from any thread.
+        void push(T value) {
+            push(new Node(std::move(value)));
+        }
+
+        // Consumer thread only.
+        bool pop(T& out) {
+            auto tail = m_tail;
+            auto next = tail->next.load(std::memory_order_acquire);
+            if (tail == &m_stub) {
+                if (next == nullptr) { return false; }
+                m_tail = next;
+                tail = next;
+                next = next->next.load(std::memory_order_acquire);
+            }
+            if (next == nullptr) {
+                if (tail != m_head.load(std::memory_order_acquire)) { return false; }
+                push(&m_stub);
+                next = tail->next.load(std::memory_order_acquire);
+                if (next == nullptr) { return false; }
+            }
+            m_tail = next;
+            std::unique_ptr<Node> node(tail);
+            out = std::move(node->value);
+            return true;
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,124 @@
+#include <algorithm>
+#include <exception>
+
+#include "pool.hpp"
+
+namespace microhal {
+    namespace {
+        // the pool and index of the worker running on this thread, if any
+        thread_local const ThreadPool* current_pool = nullptr;
+        thread_local std::size_t current_index = 0;
+    }
+
+    ThreadPool::ThreadPool(std::size_t threads) : m_pending(0), m_next(0) {
+        if (threads == 0) { threads = std::max(1u, std::thread::hardware_concurrency()); }
+        for (std::size_t i = 0; i < threads; ++i) { m_queues.emplace_back(new Queue()); }
+        for (std::size_t i = 0; i < threads; ++i) { m_threads.emplace_back(&ThreadPool::run, this, i); }
+    }
+
+    ThreadPool::~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopping = true;
+        }
+        m_ready.notify_all();
+        for (auto& t : m_threads) { t.join(); }
+    }
+
+    std::size_t ThreadPool::size() const {
+        return m_threads.size();
+    }
+
+    std::size_t ThreadPool::self() const {
+        return current_pool == this ? current_index : m_queues.size();
+    }
+
+    bool ThreadPool::pop(std::size_t self, std::function<void()>& task) {
+        if (self < m_queues.size()) {
+            auto& own = *m_queues[self];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty()) {
+                task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                m_pending.fetch_sub(1);
+                return true;
+            }
+        }
+        for (std::size_t i = 1; i <= m_queues.size(); ++i) {
+            auto& victim = *m_queues[(self + i) % m_queues.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                m_pending.fetch_sub(1);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void ThreadPool::run(std::size_t index) {
+        current_pool = this;
+        current_index = index;
+        std::function<void()> task;
+        while (true) {
+            if (pop(index, task)) {
+                task();
+                task = nullptr;
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_ready.wait(lock, [this]() { return m_stopping || m_pending.load() != 0; });
+            if (m_stopping && m_pending.load() == 0) { return; }
+        }
+    }
+
+    void ThreadPool::submit(std::function<void()> task) {
+        auto index = self();
+        if (index == m_queues.size()) { index = m_next.fetch_add(1, std::memory_order_relaxed) % m_queues.size(); }
+        // counted before it is queued, so a pop never takes m_pending below zero
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_pending.fetch_add(1);
+        }
+        {
+            auto& q = *m_queues[index];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            q.tasks.push_back(std::move(task));
+        }
+        m_ready.notify_one();
+    }
+
+    void ThreadPool::parallel_for(std::size_t n, const std::function<void(std::size_t)>& f) {
+        std::atomic<std::size_t> remaining(n);
+        std::exception_ptr error;
+        std::mutex mutex;
+        std::condition_variable done;
+        auto part = [&](std::size_t i) {
+            try {
+                f(i);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!error) { error = std::current_exception(); }
+            }
+            // under the lock, so the caller cannot return and destroy the
+            // mutex before the last part is done with it
+            std::lock_guard<std::mutex> lock(mutex);
+            if (remaining.fetch_sub(1) == 1) { done.notify_all(); }
+        };
+
+        for (std::size_t i = 1; i < n; ++i) { submit([&part, i]() { part(i); }); }
+        if (n != 0) { part(0); }
+
+        // Helping keeps a worker that calls parallel_for from waiting on
+        // tasks that sit in its own deque.
+        std::function<void()> task;
+        while (remaining.load() != 0 && pop(self(), task)) {
+            task();
+            task = nullptr;
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [&]() { return remaining.load() == 0; });
+        if (error) { std::rethrow_exception(error); }
+    }
+}
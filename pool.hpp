@@ -0,0 +1,58 @@
+#ifndef MICROHAL_POOL_H
+#define MICROHAL_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace microhal {
+
+    // Work-stealing thread pool meant to live as long as the server. Every
+    // worker has its own deque: it takes its newest task first and, when
+    // out of work, steals the oldest task of another worker. Tasks are
+    // submitted to the submitting worker's deque, or spread round robin
+    // when submitted from outside the pool.
+    //
+    // Each worker is a thread of its own, so random() already gives every
+    // worker an independent generator.
+    class ThreadPool {
+        struct Queue {
+            std::mutex                        mutex;
+            std::deque<std::function<void()>> tasks;
+        };
+
+        std::vector<std::unique_ptr<Queue>> m_queues;
+        std::vector<std::thread>            m_threads;
+        std::atomic<std::size_t>            m_pending;
+        std::atomic<std::size_t>            m_next;
+        bool                                m_stopping = false;
+        std::mutex                          m_mutex;
+        std::condition_variable             m_ready;
+
+        std::size_t self() const;
+        bool pop(std::size_t self, std::function<void()>& task);
+        void run(std::size_t index);
+
+    public:
+        // 0 threads means one per hardware thread
+        explicit ThreadPool(std::size_t threads = 0);
+        ~ThreadPool();
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        std::size_t size() const;
+        // task must not throw
+        void submit(std::function<void()> task);
+        // Runs f(0) .. f(n - 1) on the pool and the calling thread, which
+        // helps with queued tasks until all are done. The first exception
+        // thrown by f is rethrown here.
+        void parallel_for(std::size_t n, const std::function<void(std::size_t)>& f);
+    };
+}
+
+#endif
@@ -0,0 +1,193 @@
+#include <algorithm>
+#include <iomanip>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include "report.hpp"
+
+namespace microhal {
+    namespace {
+        // Fewer prefixes than this per thread are not worth starting one.
+        const std::size_t min_chunk = 16384;
+
+        using Hot = std::pair<std::size_t, const Prefix*>;
+
+        struct Partial {
+            BrainReport      report;
+            std::vector<Hot> hot;
+        };
+
+        void record(std::vector<std::uint64_t>& histogram, std::size_t n) {
+            std::size_t b = n == 0 ? 0 : static_cast<std::size_t>(64 - __builtin_clzll(n));
+            if (histogram.size() <= b) { histogram.resize(b + 1); }
+            ++histogram[b];
+        }
+
+        void merge(std::vector<std::uint64_t>& to, const std::vector<std::uint64_t>& from) {
+            if (to.size() < from.size()) { to.resize(from.size()); }
+            for (std::size_t i = 0; i < from.size(); ++i) { to[i] += from[i]; }
+        }
+
+        void merge(BrainReport::Direction& to, const BrainReport::Direction& from) {
+            to.entries += from.entries;
+            to.max = std::max(to.max, from.max);
+            to.bytes += from.bytes;
+            merge(to.sizes, from.sizes);
+        }
+
+        // More seen first; equal counts go by prefix key so the report does
+        // not depend on where the prefixes happen to live in memory.
+        bool hotter(const Hot& a, const Hot& b) {
+            if (a.first != b.first) { return a.first > b.first; }
+            return *a.second < *b.second;
+        }
+
+        // Keeps the top hottest prefixes in a heap with the coldest in front.
+        void offer(std::vector<Hot>& heap, std::size_t top, Hot h) {
+            if (top == 0) { return; }
+            if (heap.size() < top) {
+                heap.push_back(h);
+                std::push_heap(heap.begin(), heap.end(), hotter);
+            } else if (hotter(h, heap.front())) {
+                std::pop_heap(heap.begin(), heap.end(), hotter);
+                heap.back() = h;
+                std::push_heap(heap.begin(), heap.end(), hotter);
+            }
+        }
+
+        std::size_t scan(const SuffixMap& sm, BrainReport::Direction& d) {
+            auto entries = sm.entry_count();
+            auto bytes = sm.memory_usage();
+            d.entries += entries;
+            d.max = std::max(d.max, entries);
+            d.bytes += bytes;
+            record(d.sizes, entries);
+            return bytes;
+        }
+
+        void scan(PrefixMap::const_iterator first, PrefixMap::const_iterator last, std::size_t top, Partial& out) {
+            auto& r = out.report;
+            for (auto it = first; it != last; ++it) {
+                auto bytes = prefix_bytes(it->first);
+                r.prefix_bytes += bytes;
+                bytes += scan(it->second.first, r.backward);
+                bytes += scan(it->second.second, r.forward);
+                auto seen = it->second.second.size();
+                if (seen <= 1) { r.single_use_bytes += bytes; }
+                record(r.counts, seen);
+                offer(out.hot, top, Hot(seen, &it->first));
+                ++r.prefixes;
+            }
+        }
+
+        std::string range(std::size_t bucket) {
+            if (bucket <= 1) { return std::to_string(bucket); }
+            auto low = std::size_t(1) << (bucket - 1);
+            return std::to_string(low) + "-" + std::to_string(2 * low - 1);
+        }
+    }
+
+    std::size_t BrainReport::total_bytes() const {
+        return prefix_bytes + backward.bytes + forward.bytes + keyword_bytes;
+    }
+
+    BrainReport Microhal::analyze(std::size_t threads, std::size_t top) const {
+        // One pass over the prefixes, split into contiguous ranges that are
+        // scanned in parallel and merged. The brain must not be written to
+        // meanwhile.
+        if (threads == 0) { threads = std::max(1u, std::thread::hardware_concurrency()); }
+        threads = std::max<std::size_t>(1, std::min(threads, m_prefixes.size() / min_chunk));
+
+        std::vector<PrefixMap::const_iterator> bounds{m_prefixes.begin()};
+        for (std::size_t i = 1; i < threads; ++i) {
+            bounds.push_back(std::next(bounds.back(), static_cast<std::ptrdiff_t>(m_prefixes.size() / threads)));
+        }
+        bounds.push_back(m_prefixes.end());
+
+        std::vector<Partial> partials(threads);
+        std::vector<std::thread> workers;
+        for (std::size_t i = 1; i < threads; ++i) {
+            workers.emplace_back([&, i]() { scan(bounds[i], bounds[i + 1], top, partials[i]); });
+        }
+        scan(bounds[0], bounds[1], top, partials[0]);
+
+        BrainReport r;
+        r.order = m_order;
+        r.tokens = m_keywords.size();
+        for (auto& kw : m_keywords) { r.keyword_bytes += entry_bytes(kw.first); }
+
+        std::vector<Hot> hot;
+        for (auto& w : workers) { w.join(); }
+        for (auto& p : partials) {
+            r.prefixes += p.report.prefixes;
+            r.prefix_bytes += p.report.prefix_bytes;
+            r.single_use_bytes += p.report.single_use_bytes;
+            merge(r.backward, p.report.backward);
+            merge(r.forward, p.report.forward);
+            merge(r.counts, p.report.counts);
+            for (auto& h : p.hot) { offer(hot, top, h); }
+        }
+        std::sort(hot.begin(), hot.end(), hotter);
+        for (auto& h : hot) {
+            r.hot.push_back(BrainReport::HotPrefix{std::vector<Token>(h.second->begin(), h.second->end()), h.first});
+        }
+        return r;
+    }
+
+    std::ostream& operator<<(std::ostream& os, const BrainReport& r) {
+        os << "order: " << r.order << "\n"
+           << "prefixes: " << r.prefixes << "\n"
+           << "tokens: " << r.tokens << "\n"
+           << "suffixes: " << r.backward.entries << " backward (max " << r.backward.max << "), "
+           << r.forward.entries << " forward (max " << r.forward.max << ")\n";
+
+        auto rows = std::max({r.backward.sizes.size(), r.forward.sizes.size(), r.counts.size()});
+        auto at = [](const std::vector<std::uint64_t>& v, std::size_t i) { return i < v.size() ? v[i] : 0; };
+        os << std::left << std::setw(16) << "size" << std::right
+           << std::setw(12) << "backward" << std::setw(12) << "forward" << std::setw(12) << "seen" << "\n";
+        for (std::size_t i = 0; i < rows; ++i) {
+            os << std::left << std::setw(16) << range(i) << std::right
+               << std::setw(12) << at(r.backward.sizes, i)
+               << std::setw(12) << at(r.forward.sizes, i)
+               << std::setw(12) << at(r.counts, i) << "\n";
+        }
+
+        os << "bytes: " << r.total_bytes() << " total, " << r.prefix_bytes << " prefixes, "
+           << r.backward.bytes << " backward, " << r.forward.bytes << " forward, "
+           << r.keyword_bytes << " keywords, " << r.single_use_bytes << " in prefixes seen once\n";
+
+        os << "hot prefixes:\n";
+        for (auto& h : r.hot) {
+            os << std::setw(10) << h.count << " ";
+            for (auto& t : h.tokens) { os << " \"" << t << "\""; }
+            os << "\n";
+        }
+        return os;
+    }
+
+    void to_json(json& j, const BrainReport::Direction& d) {
+        j = {{"entries", d.entries}, {"max", d.max}, {"sizes", d.sizes}, {"bytes", d.bytes}};
+    }
+
+    void to_json(json& j, const BrainReport& r) {
+        json hot = json::array();
+        for (auto& h : r.hot) { hot.push_back({{"tokens", h.tokens}, {"count", h.count}}); }
+        j = {
+            {"order", r.order},
+            {"prefixes", r.prefixes},
+            {"tokens", r.tokens},
+            {"backward", r.backward},
+            {"forward", r.forward},
+            {"counts", r.counts},
+            {"hot", hot},
+            {"bytes", {
+                {"total", r.total_bytes()},
+                {"prefixes", r.prefix_bytes},
+                {"keywords", r.keyword_bytes},
+                {"single_use", r.single_use_bytes}
+            }}
+        };
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef MICROHAL_REPORT_H
+#define MICROHAL_REPORT_H
+
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+#include "microhal.hpp"
+
+namespace microhal {
+
+    // Shape of a brain, for choosing memory limits and container sizes.
+    // Histograms are bucketed by bit length: bucket b counts values in
+    // [2^(b-1), 2^b), and bucket 0 counts zeros. Bytes are the estimates
+    // used by memory accounting.
+    struct BrainReport {
+        struct Direction {
+            // distinct suffixes over all maps, and per map
+            std::size_t                entries = 0;
+            std::size_t                max = 0;
+            std::vector<std::uint64_t> sizes;
+            std::size_t                bytes = 0;
+        };
+
+        struct HotPrefix {
+            std::vector<Token> tokens;
+            std::size_t        count;
+        };
+
+        int                        order = 0;
+        std::size_t                prefixes = 0;
+        std::size_t                tokens = 0;
+        Direction                  backward;
+        Direction                  forward;
+        // prefixes by how often they were seen, and the most seen ones
+        std::vector<std::uint64_t> counts;
+        std::vector<HotPrefix>     hot;
+        std::size_t                prefix_bytes = 0;
+        std::size_t                keyword_bytes = 0;
+        // freed by evicting every prefix seen only once
+        std::size_t                single_use_bytes = 0;
+
+        std::size_t total_bytes() const;
+    };
+
+    void to_json(json& j, const BrainReport& r);
+    std::ostream& operator<<(std::ostream& os, const BrainReport& r);
+}
+
+#endif
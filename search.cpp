@@ -0,0 +1,75 @@
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MICROHAL_X86 1
+#endif
+
+#include "search.hpp"
+
+namespace microhal {
+    namespace {
+        // A count and the largest range it beats binary search on, as
+        // measured by the sample_* benchmarks.
+        struct Scan {
+            std::size_t (*count)(const std::uint32_t*, std::size_t, std::uint32_t);
+            std::size_t window;
+        };
+
+        Scan pick() {
+            return has_avx2() ? Scan{count_below_avx2, 256} : Scan{count_below_scalar, 32};
+        }
+    }
+
+    bool has_avx2() {
+#ifdef MICROHAL_X86
+        static const bool avx2 = __builtin_cpu_supports("avx2");
+        return avx2;
+#else
+        return false;
+#endif
+    }
+
+    std::size_t count_below_scalar(const std::uint32_t* first, std::size_t n, std::uint32_t value) {
+        std::size_t below = 0;
+        for (std::size_t i = 0; i < n; ++i) { below += first[i] < value; }
+        return below;
+    }
+
+#ifdef MICROHAL_X86
+    __attribute__((target("avx2")))
+    std::size_t count_below_avx2(const std::uint32_t* first, std::size_t n, std::uint32_t value) {
+        // AVX2 only compares signed integers, so both sides are shifted by
+        // 2^31 to compare as unsigned.
+        const auto bias = _mm256_set1_epi32(INT32_MIN);
+        const auto v = _mm256_xor_si256(_mm256_set1_epi32(static_cast<int>(value)), bias);
+        std::size_t below = 0;
+        std::size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            auto x = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(first + i)), bias);
+            auto mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(v, x)));
+            below += static_cast<std::size_t>(__builtin_popcount(static_cast<unsigned>(mask)));
+        }
+        return below + count_below_scalar(first + i, n - i, value);
+    }
+#else
+    std::size_t count_below_avx2(const std::uint32_t* first, std::size_t n, std::uint32_t value) {
+        return count_below_scalar(first, n, value);
+    }
+#endif
+
+    std::size_t count_below(const std::uint32_t* first, std::size_t n, std::uint32_t value) {
+        // most suffix sets hold a token or two, too few for a vector
+        if (n < 8) { return count_below_scalar(first, n, value); }
+        static const Scan scan = pick();
+        auto p = first;
+        while (n > scan.window) {
+            auto half = n / 2;
+            if (p[half] < value) {
+                p += half + 1;
+                n -= half + 1;
+            } else {
+                n = half;
+            }
+        }
+        return static_cast<std::size_t>(p - first) + scan.count(p, n, value);
+    }
+}
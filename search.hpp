@@ -0,0 +1,23 @@
+#ifndef MICROHAL_SEARCH_H
+#define MICROHAL_SEARCH_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace microhal {
+
+    // Number of values in the ascending range [first, first + n) that are
+    // below value, i.e. the offset std::lower_bound would return. Large
+    // ranges are narrowed by binary search down to a window that is then
+    // counted in full, which takes no data-dependent branches. Counting
+    // uses AVX2 when the CPU has it.
+    std::size_t count_below(const std::uint32_t* first, std::size_t n, std::uint32_t value);
+
+    // The window counts count_below picks from, exposed for benchmarks.
+    // count_below_avx2 must only be called when has_avx2() is true.
+    bool has_avx2();
+    std::size_t count_below_scalar(const std::uint32_t* first, std::size_t n, std::uint32_t value);
+    std::size_t count_below_avx2(const std::uint32_t* first, std::size_t n, std::uint32_t value);
+}
+
+#endif
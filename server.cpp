@@ -0,0 +1,361 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "server.hpp"
+
+namespace microhal {
+    namespace {
+        const std::uint64_t listen_id = 0;
+        const std::uint64_t wake_id = 1;
+        // longer lines are refused and the connection closed
+        const std::size_t max_line = 64 * 1024;
+
+        void check(int result, const char* what) {
+            if (result < 0) {
+                throw std::runtime_error(std::string("Server: ") + what + ": " + std::strerror(errno));
+            }
+        }
+
+        void set_nonblocking(int fd) {
+            check(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK), "fcntl");
+        }
+
+        int listen_on(const std::string& address) {
+            int fd;
+            if (address.compare(0, 5, "unix:") == 0) {
+                auto path = address.substr(5);
+                sockaddr_un addr;
+                std::memset(&addr, 0, sizeof(addr));
+                addr.sun_family = AF_UNIX;
+                if (path.size() >= sizeof(addr.sun_path)) { throw std::runtime_error("Server: socket path too long"); }
+                std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+                fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+                check(fd, "socket");
+                ::unlink(path.c_str());
+                check(::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)), "bind");
+            } else if (address.compare(0, 4, "tcp:") == 0) {
+                sockaddr_in addr;
+                std::memset(&addr, 0, sizeof(addr));
+                addr.sin_family = AF_INET;
+                addr.sin_port = htons(static_cast<std::uint16_t>(std::stoul(address.substr(4))));
+                addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+                fd = ::socket(AF_INET, SOCK_STREAM, 0);
+                check(fd, "socket");
+                int one = 1;
+                ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+                check(::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)), "bind");
+            } else {
+                throw std::invalid_argument("Server: address must be unix:PATH or tcp:PORT");
+            }
+            check(::listen(fd, SOMAXCONN), "listen");
+            set_nonblocking(fd);
+            return fd;
+        }
+    }
+
+    Server::Server(Microhal& brain, const ServerOptions& options)
+    : m_brain(brain), m_options(options), m_running(true) {
+        m_listen = listen_on(m_options.address);
+        m_epoll = epoll_create1(0);
+        check(m_epoll, "epoll_create1");
+        m_wake = eventfd(0, EFD_NONBLOCK);
+        check(m_wake, "eventfd");
+        watch(m_listen, listen_id, false);
+        watch(m_wake, wake_id, false);
+        if (m_options.async_learn) { m_learner.reset(new AsyncLearner(m_brain, m_brain_mutex)); }
+        if (m_options.generation_threads != 0) {
+            m_generators.reset(new ThreadPool(m_options.generation_threads));
+            m_options.reply.pool = m_generators.get();
+            if (m_options.reply.pool_tasks == 0) {
+                m_options.reply.pool_tasks = std::max<std::size_t>(1, m_options.generation_threads / std::max<std::size_t>(1, m_options.workers));
+            }
+        }
+    }
+
+    Server::~Server() {
+        for (auto& c : m_connections) { ::close(c.second.fd); }
+        if (m_wake >= 0) { ::close(m_wake); }
+        if (m_epoll >= 0) { ::close(m_epoll); }
+        if (m_listen >= 0) { ::close(m_listen); }
+        if (m_options.address.compare(0, 5, "unix:") == 0) { ::unlink(m_options.address.substr(5).c_str()); }
+    }
+
+    void Server::watch(int fd, std::uint64_t id, bool out) {
+        epoll_event event;
+        std::memset(&event, 0, sizeof(event));
+        event.events = out ? EPOLLIN | EPOLLOUT : EPOLLIN;
+        event.data.u64 = id;
+        if (epoll_ctl(m_epoll, EPOLL_CTL_MOD, fd, &event) < 0) {
+            check(epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &event), "epoll_ctl");
+        }
+    }
+
+    void Server::run() {
+        m_stopping = false;
+        for (std::size_t i = 0; i < std::max<std::size_t>(1, m_options.workers); ++i) {
+            m_workers.emplace_back(&Server::work, this);
+        }
+
+        std::vector<epoll_event> events(256);
+        while (m_running) {
+            auto n = epoll_wait(m_epoll, events.data(), static_cast<int>(events.size()), -1);
+            if (n < 0 && errno == EINTR) { continue; }
+            check(n, "epoll_wait");
+            for (int i = 0; i < n; ++i) {
+                auto id = events[static_cast<std::size_t>(i)].data.u64;
+                auto flags = events[static_cast<std::size_t>(i)].events;
+                if (id == listen_id) { accept_connections(); }
+                else if (id == wake_id) {
+                    std::uint64_t count;
+                    while (::read(m_wake, &count, sizeof(count)) > 0) {}
+                    complete();
+                } else {
+                    if (flags & EPOLLOUT) { send(id); }
+                    if (flags & (EPOLLIN | EPOLLHUP | EPOLLERR)) { receive(id); }
+                }
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_jobs_mutex);
+            m_stopping = true;
+        }
+        m_jobs_ready.notify_all();
+        for (auto& w : m_workers) { w.join(); }
+        m_workers.clear();
+    }
+
+    void Server::stop() {
+        m_running = false;
+        std::uint64_t one = 1;
+        auto written = ::write(m_wake, &one, sizeof(one));
+        (void)written;
+    }
+
+    void Server::accept_connections() {
+        while (true) {
+            auto fd = ::accept(m_listen, nullptr, nullptr);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) { continue; }
+                return;
+            }
+            set_nonblocking(fd);
+            int one = 1;
+            ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            auto id = m_next_id++;
+            m_connections[id].fd = fd;
+            watch(fd, id, false);
+        }
+    }
+
+    void Server::receive(std::uint64_t id) {
+        auto it = m_connections.find(id);
+        if (it == m_connections.end()) { return; }
+        auto& c = it->second;
+        if (c.closing) { return; }
+        char buffer[16384];
+        while (true) {
+            auto n = ::recv(c.fd, buffer, sizeof(buffer), 0);
+            if (n > 0) { c.in.append(buffer, static_cast<std::size_t>(n)); continue; }
+            if (n < 0 && errno == EINTR) { continue; }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) { break; }
+            // closed by the peer: answer what it sent, then close
+            c.closing = true;
+            break;
+        }
+
+        std::size_t start = 0;
+        for (auto end = c.in.find('\n'); end != std::string::npos; end = c.in.find('\n', start)) {
+            auto line = c.in.substr(start, end - start);
+            if (!line.empty() && line.back() == '\r') { line.pop_back(); }
+            c.pending.push_back(std::move(line));
+            start = end + 1;
+        }
+        c.in.erase(0, start);
+        if (c.in.size() > max_line) {
+            c.out += "error line too long\n";
+            c.in.clear();
+            c.pending.clear();
+            c.closing = true;
+        }
+
+        if (m_options.cancel_stale && c.busy && !c.pending.empty()) { c.running->cancel(); }
+        dispatch(id);
+        if (c.closing) {
+            epoll_ctl(m_epoll, EPOLL_CTL_DEL, c.fd, nullptr);
+            ::shutdown(c.fd, SHUT_RD);
+            send(id);
+        }
+    }
+
+    void Server::send(std::uint64_t id) {
+        auto it = m_connections.find(id);
+        if (it == m_connections.end()) { return; }
+        auto& c = it->second;
+        std::size_t sent = 0;
+        while (sent < c.out.size()) {
+            auto n = ::send(c.fd, c.out.data() + sent, c.out.size() - sent, MSG_NOSIGNAL);
+            if (n > 0) { sent += static_cast<std::size_t>(n); continue; }
+            if (n < 0 && errno == EINTR) { continue; }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) { break; }
+            close(id);
+            return;
+        }
+        c.out.erase(0, sent);
+        if (c.closing) {
+            // done once every request is answered and written
+            if (!c.busy && c.pending.empty() && c.out.empty()) { close(id); }
+            else if (!c.out.empty()) {
+                epoll_event event;
+                std::memset(&event, 0, sizeof(event));
+                event.events = EPOLLOUT;
+                event.data.u64 = id;
+                if (epoll_ctl(m_epoll, EPOLL_CTL_MOD, c.fd, &event) < 0) { epoll_ctl(m_epoll, EPOLL_CTL_ADD, c.fd, &event); }
+            }
+            return;
+        }
+        watch(c.fd, id, !c.out.empty());
+    }
+
+    void Server::dispatch(std::uint64_t id) {
+        auto& c = m_connections.at(id);
+        if (c.busy || c.pending.empty()) { return; }
+        c.busy = true;
+        c.running = std::make_shared<CancelToken>();
+        {
+            std::lock_guard<std::mutex> lock(m_jobs_mutex);
+            m_jobs.push_back(Job{id, std::move(c.pending.front()), c.running});
+        }
+        c.pending.pop_front();
+        m_jobs_ready.notify_one();
+    }
+
+    void Server::complete() {
+        std::vector<Job> done;
+        {
+            std::lock_guard<std::mutex> lock(m_done_mutex);
+            done.swap(m_done);
+        }
+        for (auto& d : done) {
+            auto it = m_connections.find(d.connection);
+            if (it == m_connections.end()) { continue; }
+            auto& c = it->second;
+            c.busy = false;
+            c.running.reset();
+            c.out += d.line;
+            c.out += '\n';
+            dispatch(d.connection);
+            send(d.connection);
+        }
+    }
+
+    void Server::close(std::uint64_t id) {
+        auto it = m_connections.find(id);
+        if (it == m_connections.end()) { return; }
+        epoll_ctl(m_epoll, EPOLL_CTL_DEL, it->second.fd, nullptr);
+        ::close(it->second.fd);
+        m_connections.erase(it);
+    }
+
+    void Server::work() {
+        while (true) {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(m_jobs_mutex);
+                m_jobs_ready.wait(lock, [this]() { return m_stopping || !m_jobs.empty(); });
+                if (m_stopping) { return; }
+                job = std::move(m_jobs.front());
+                m_jobs.pop_front();
+            }
+            job.line = execute(job.line, job.cancel.get());
+            job.cancel.reset();
+            {
+                std::lock_guard<std::mutex> lock(m_done_mutex);
+                m_done.push_back(std::move(job));
+            }
+            std::uint64_t one = 1;
+            auto written = ::write(m_wake, &one, sizeof(one));
+            (void)written;
+        }
+    }
+
+    std::string Server::execute(const std::string& line, const CancelToken* cancel) {
+        auto space = line.find(' ');
+        auto command = line.substr(0, space);
+        auto text = space == std::string::npos ? std::string() : line.substr(space + 1);
+        auto options = m_options.reply;
+        options.cancel = cancel;
+        try {
+            if (command == "reply") {
+                std::shared_lock<std::shared_timed_mutex> lock(m_brain_mutex);
+                return m_brain.reply(text, options);
+            }
+            if (command == "learn" && m_learner) {
+                m_learner->learn(text);
+                return "ok";
+            }
+            if (command == "add" && m_learner) {
+                std::string reply;
+                try {
+                    std::shared_lock<std::shared_timed_mutex> lock(m_brain_mutex);
+                    reply = m_brain.reply(text, options);
+                } catch (const ReplyCancelled&) {
+                    if (options.learn_on_cancel) { m_learner->learn(text); }
+                    throw;
+                }
+                m_learner->learn(text);
+                return reply;
+            }
+            if (command == "learn") {
+                std::unique_lock<std::shared_timed_mutex> lock(m_brain_mutex);
+                m_brain.learn(text);
+                return "ok";
+            }
+            if (command == "add") {
+                std::unique_lock<std::shared_timed_mutex> lock(m_brain_mutex);
+                return m_brain.add(text, options);
+            }
+            if (command == "save") {
+                if (m_learner) { m_learner->flush(); }
+                std::shared_lock<std::shared_timed_mutex> lock(m_brain_mutex);
+                std::ofstream o(m_options.db);
+                o << json(m_brain) << std::endl;
+                if (!o) { return "error could not write " + m_options.db; }
+                return "ok";
+            }
+            if (command == "stats") {
+                std::shared_lock<std::shared_timed_mutex> lock(m_brain_mutex);
+                auto& requests = m_brain.stats().stage(Stage::request);
+                return json{
+                    {"prefixes", m_brain.prefix_count()},
+                    {"tokens", m_brain.token_count()},
+                    {"memory", m_brain.memory_usage()},
+                    {"requests", requests.count()},
+                    {"p50_ns", requests.percentile(50)},
+                    {"p99_ns", requests.percentile(99)},
+                    {"p999_ns", requests.percentile(99.9)},
+                    {"learn_pending", m_learner ? m_learner->pending() : 0},
+                    {"learn_failed", m_learner ? m_learner->failed() : 0}
+                }.dump();
+            }
+            return "error unknown command " + command;
+        } catch (const ReplyCancelled&) {
+            return "cancelled";
+        } catch (const std::exception& e) {
+            return std::string("error ") + e.what();
+        }
+    }
+}
@@ -0,0 +1,116 @@
+#ifndef MICROHAL_SERVER_H
+#define MICROHAL_SERVER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "learner.hpp"
+#include "microhal.hpp"
+#include "pool.hpp"
+
+namespace microhal {
+
+    struct ServerOptions {
+        // "unix:PATH" for a Unix domain socket, or "tcp:PORT" on localhost
+        std::string  address = "tcp:5555";
+        std::size_t  workers = 4;
+        std::string  db = "db.json";
+        // learn on a background thread and answer learn and add right away
+        bool         async_learn = false;
+        // extra threads that generate candidates for budgeted replies, each
+        // reply queuing reply.pool_tasks tasks on them, by default an even
+        // share of them per worker
+        std::size_t  generation_threads = 0;
+        // cancel a connection's reply in flight once it sends another
+        // request, answering the stale one with "cancelled"
+        bool         cancel_stale = false;
+        ReplyOptions reply;
+    };
+
+    // Serves a brain over a line protocol. Every request line gets exactly
+    // one answer line, in order per connection:
+    //
+    //   reply TEXT    the reply to TEXT
+    //   learn TEXT    ok, after learning TEXT
+    //   add TEXT      the reply to TEXT, then learns it
+    //   save          ok, after writing the brain to the db file
+    //   stats         one line of JSON
+    //
+    // Failures are answered with "error MESSAGE", and replies abandoned for
+    // a newer request with "cancelled".
+    //
+    // One thread runs a non-blocking epoll loop over all connections and
+    // hands requests to a pool of workers. Replies share the brain under a
+    // shared lock and learning takes it exclusively. A connection has at
+    // most one request in flight, which keeps its answers in order.
+    class Server {
+        struct Connection {
+            int                          fd;
+            std::string                  in;
+            std::string                  out;
+            std::deque<std::string>      pending;
+            // the request in flight, while busy
+            std::shared_ptr<CancelToken> running;
+            bool                         busy = false;
+            bool                         closing = false;
+        };
+
+        struct Job {
+            std::uint64_t                connection;
+            std::string                  line;
+            std::shared_ptr<CancelToken> cancel;
+        };
+
+        Microhal&                            m_brain;
+        ServerOptions                        m_options;
+        std::shared_timed_mutex              m_brain_mutex;
+        std::unique_ptr<AsyncLearner>        m_learner;
+        std::unique_ptr<ThreadPool>          m_generators;
+        int                                  m_listen = -1;
+        int                                  m_epoll = -1;
+        int                                  m_wake = -1;
+        std::atomic<bool>                    m_running;
+        std::map<std::uint64_t, Connection>  m_connections;
+        std::uint64_t                        m_next_id = 2;
+
+        std::mutex                           m_jobs_mutex;
+        std::condition_variable              m_jobs_ready;
+        std::deque<Job>                      m_jobs;
+        bool                                 m_stopping = false;
+        std::mutex                           m_done_mutex;
+        std::vector<Job>                     m_done;
+        std::vector<std::thread>             m_workers;
+
+        void watch(int fd, std::uint64_t id, bool out);
+        void accept_connections();
+        void receive(std::uint64_t id);
+        void send(std::uint64_t id);
+        void dispatch(std::uint64_t id);
+        void complete();
+        void close(std::uint64_t id);
+        void work();
+        std::string execute(const std::string& line, const CancelToken* cancel);
+
+    public:
+        Server(Microhal& brain, const ServerOptions& options);
+        ~Server();
+        Server(const Server&) = delete;
+        Server& operator=(const Server&) = delete;
+
+        // Serves until stop() is called. stop() may be called from any
+        // thread or from a signal handler.
+        void run();
+        void stop();
+    };
+}
+
+#endif
@@ -0,0 +1,256 @@
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+#include <string>
+
+#include "stats.hpp"
+
+namespace microhal {
+    namespace {
+        const char* const stage_names[stage_count] = {
+            "request", "tokenize", "rank", "candidates", "generate", "learn", "first_token"
+        };
+
+        const char* const counter_names[counter_count] = {
+            "candidates", "replies", "generated_tokens", "learned_tokens"
+        };
+
+        // Formats nanoseconds with a unit that keeps three significant digits.
+        std::string duration(double ns) {
+            std::ostringstream os;
+            os << std::setprecision(3);
+            if      (ns < 1e3) { os << ns << "ns"; }
+            else if (ns < 1e6) { os << ns / 1e3 << "us"; }
+            else if (ns < 1e9) { os << ns / 1e6 << "ms"; }
+            else               { os << ns / 1e9 << "s"; }
+            return os.str();
+        }
+    }
+
+    namespace detail {
+        thread_local StageTimes* stage_times = nullptr;
+    }
+
+    const char* stage_name(Stage s) {
+        return stage_names[static_cast<std::size_t>(s)];
+    }
+
+    const char* counter_name(Counter c) {
+        return counter_names[static_cast<std::size_t>(c)];
+    }
+
+    // LATENCY HISTOGRAM
+    constexpr unsigned LatencyHistogram::sub_bits;
+    constexpr unsigned LatencyHistogram::max_bits;
+    constexpr std::size_t LatencyHistogram::bucket_count;
+
+    LatencyHistogram::LatencyHistogram() {
+        reset();
+    }
+
+    LatencyHistogram::LatencyHistogram(const LatencyHistogram& other) {
+        *this = other;
+    }
+
+    LatencyHistogram& LatencyHistogram::operator=(const LatencyHistogram& other) {
+        for (std::size_t i = 0; i < bucket_count; ++i) {
+            m_buckets[i].store(other.m_buckets[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+        m_count.store(other.m_count.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        m_sum.store(other.m_sum.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        m_max.store(other.m_max.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        return *this;
+    }
+
+    std::size_t LatencyHistogram::bucket(std::uint64_t ns) {
+        if (ns < (std::uint64_t(1) << sub_bits)) { return static_cast<std::size_t>(ns); }
+        auto magnitude = static_cast<unsigned>(63 - __builtin_clzll(ns));
+        if (magnitude >= max_bits) { return bucket_count - 1; }
+        auto shift = magnitude - sub_bits;
+        auto sub = static_cast<std::size_t>((ns >> shift) & ((std::uint64_t(1) << sub_bits) - 1));
+        return (static_cast<std::size_t>(shift + 1) << sub_bits) + sub;
+    }
+
+    std::uint64_t LatencyHistogram::upper_bound(std::size_t bucket) {
+        auto shift = bucket >> sub_bits;
+        auto sub = bucket & ((std::size_t(1) << sub_bits) - 1);
+        if (shift == 0) { return sub; }
+        auto low = (std::uint64_t(1) << sub_bits | sub) << (shift - 1);
+        return low + (std::uint64_t(1) << (shift - 1)) - 1;
+    }
+
+    void LatencyHistogram::record(std::uint64_t ns) {
+        m_buckets[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+        m_count.fetch_add(1, std::memory_order_relaxed);
+        m_sum.fetch_add(ns, std::memory_order_relaxed);
+        auto max = m_max.load(std::memory_order_relaxed);
+        while (ns > max && !m_max.compare_exchange_weak(max, ns, std::memory_order_relaxed)) {}
+    }
+
+    void LatencyHistogram::reset() {
+        for (auto& b : m_buckets) { b.store(0, std::memory_order_relaxed); }
+        m_count.store(0, std::memory_order_relaxed);
+        m_sum.store(0, std::memory_order_relaxed);
+        m_max.store(0, std::memory_order_relaxed);
+    }
+
+    std::uint64_t LatencyHistogram::count() const {
+        return m_count.load(std::memory_order_relaxed);
+    }
+
+    std::uint64_t LatencyHistogram::max() const {
+        return m_max.load(std::memory_order_relaxed);
+    }
+
+    double LatencyHistogram::mean() const {
+        auto n = count();
+        return n == 0 ? 0.0 : static_cast<double>(m_sum.load(std::memory_order_relaxed)) / static_cast<double>(n);
+    }
+
+    std::uint64_t LatencyHistogram::percentile(double p) const {
+        auto n = count();
+        if (n == 0) { return 0; }
+        auto rank = static_cast<std::uint64_t>(p / 100.0 * static_cast<double>(n) + 0.5);
+        rank = std::max<std::uint64_t>(1, std::min(rank, n));
+        std::uint64_t seen = 0;
+        for (std::size_t i = 0; i < bucket_count; ++i) {
+            seen += m_buckets[i].load(std::memory_order_relaxed);
+            if (seen >= rank) { return std::min(upper_bound(i), max()); }
+        }
+        return max();
+    }
+
+    // STATS
+    Stats::Stats() {
+        reset();
+    }
+
+    Stats::Stats(const Stats& other) {
+        *this = other;
+    }
+
+    Stats& Stats::operator=(const Stats& other) {
+        m_stages = other.m_stages;
+        for (std::size_t i = 0; i < counter_count; ++i) {
+            m_counters[i].store(other.m_counters[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+        return *this;
+    }
+
+    LatencyHistogram& Stats::stage(Stage s) {
+        return m_stages[static_cast<std::size_t>(s)];
+    }
+
+    const LatencyHistogram& Stats::stage(Stage s) const {
+        return m_stages[static_cast<std::size_t>(s)];
+    }
+
+    void Stats::add(Counter c, std::uint64_t n) {
+        m_counters[static_cast<std::size_t>(c)].fetch_add(n, std::memory_order_relaxed);
+    }
+
+    std::uint64_t Stats::counter(Counter c) const {
+        return m_counters[static_cast<std::size_t>(c)].load(std::memory_order_relaxed);
+    }
+
+    void Stats::reset() {
+        for (auto& h : m_stages) { h.reset(); }
+        for (auto& c : m_counters) { c.store(0, std::memory_order_relaxed); }
+    }
+
+    std::ostream& operator<<(std::ostream& os, const Stats& s) {
+#ifdef MICROHAL_NO_STATS
+        os << "(built with MICROHAL_NO_STATS)\n";
+#endif
+        os << std::left << std::setw(12) << "stage" << std::right
+           << std::setw(10) << "count" << std::setw(10) << "mean" << std::setw(10) << "p50"
+           << std::setw(10) << "p99" << std::setw(10) << "p999" << std::setw(10) << "max" << "\n";
+        for (std::size_t i = 0; i < stage_count; ++i) {
+            auto& h = s.m_stages[i];
+            os << std::left << std::setw(12) << stage_names[i] << std::right
+               << std::setw(10) << h.count()
+               << std::setw(10) << duration(h.mean())
+               << std::setw(10) << duration(static_cast<double>(h.percentile(50)))
+               << std::setw(10) << duration(static_cast<double>(h.percentile(99)))
+               << std::setw(10) << duration(static_cast<double>(h.percentile(99.9)))
+               << std::setw(10) << duration(static_cast<double>(h.max())) << "\n";
+        }
+        for (std::size_t i = 0; i < counter_count; ++i) {
+            os << counter_names[i] << ": " << s.m_counters[i].load(std::memory_order_relaxed) << "\n";
+        }
+        return os;
+    }
+
+    // SLOW LOG
+    SlowLog::SlowLog(std::uint64_t threshold_ns, std::size_t capacity)
+    : m_threshold(threshold_ns), m_capacity(capacity) {
+    }
+
+    SlowLog::SlowLog(const SlowLog& other) : m_threshold(other.threshold()), m_capacity(other.m_capacity) {
+        std::lock_guard<std::mutex> lock(other.m_mutex);
+        m_requests = other.m_requests;
+    }
+
+    SlowLog& SlowLog::operator=(const SlowLog& other) {
+        if (this == &other) { return *this; }
+        std::lock(m_mutex, other.m_mutex);
+        std::lock_guard<std::mutex> a(m_mutex, std::adopt_lock);
+        std::lock_guard<std::mutex> b(other.m_mutex, std::adopt_lock);
+        m_threshold.store(other.threshold(), std::memory_order_relaxed);
+        m_capacity = other.m_capacity;
+        m_requests = other.m_requests;
+        return *this;
+    }
+
+    void SlowLog::set_threshold(std::uint64_t ns) {
+        m_threshold.store(ns, std::memory_order_relaxed);
+    }
+
+    std::uint64_t SlowLog::threshold() const {
+        return m_threshold.load(std::memory_order_relaxed);
+    }
+
+    void SlowLog::set_capacity(std::size_t capacity) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_capacity = capacity;
+        while (m_requests.size() > m_capacity) { m_requests.pop_front(); }
+    }
+
+    bool SlowLog::slow(std::uint64_t ns) const {
+        auto t = threshold();
+        return t != 0 && ns >= t;
+    }
+
+    void SlowLog::record(SlowRequest request) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_capacity == 0) { return; }
+        if (m_requests.size() == m_capacity) { m_requests.pop_front(); }
+        m_requests.push_back(std::move(request));
+    }
+
+    std::vector<SlowRequest> SlowLog::requests() const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return std::vector<SlowRequest>(m_requests.begin(), m_requests.end());
+    }
+
+    void SlowLog::clear() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_requests.clear();
+    }
+
+    std::ostream& operator<<(std::ostream& os, const SlowLog& log) {
+        for (auto& r : log.requests()) {
+            char time[32];
+            std::strftime(time, sizeof(time), "%Y-%m-%d %H:%M:%S", std::localtime(&r.time));
+            os << time << " " << duration(static_cast<double>(r.total_ns))
+               << ", keyword \"" << r.keyword << "\", " << r.candidates << " candidates, "
+               << r.reply_length << " byte reply\n ";
+            for (std::size_t i = 0; i < stage_count; ++i) {
+                if (static_cast<Stage>(i) == Stage::request) { continue; }
+                os << " " << stage_names[i] << " " << duration(static_cast<double>(r.stages[i]));
+            }
+            os << "\n  input: " << r.input << "\n";
+        }
+        return os;
+    }
+}
@@ -0,0 +1,179 @@
+#ifndef MICROHAL_STATS_H
+#define MICROHAL_STATS_H
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <deque>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "trace.hpp"
+
+namespace microhal {
+
+    enum class Stage { request, tokenize, rank, candidates, generate, learn, first_token };
+    const std::size_t stage_count = 7;
+    const char* stage_name(Stage s);
+
+    enum class Counter { candidates, replies, generated_tokens, learned_tokens };
+    const std::size_t counter_count = 4;
+    const char* counter_name(Counter c);
+
+    // HDR-style latency histogram in nanoseconds. Values below 2^sub_bits
+    // get a bucket each, and every power of two above that is split into
+    // 2^sub_bits buckets, so percentiles are within about 3% of the true
+    // value. Recording is a relaxed atomic increment and safe from any
+    // number of threads.
+    class LatencyHistogram {
+        static constexpr unsigned sub_bits = 5;
+        static constexpr unsigned max_bits = 40;
+        static constexpr std::size_t bucket_count = (max_bits - sub_bits + 1) << sub_bits;
+
+        std::array<std::atomic<std::uint64_t>, bucket_count> m_buckets;
+        std::atomic<std::uint64_t> m_count;
+        std::atomic<std::uint64_t> m_sum;
+        std::atomic<std::uint64_t> m_max;
+
+        static std::size_t bucket(std::uint64_t ns);
+        static std::uint64_t upper_bound(std::size_t bucket);
+
+    public:
+        LatencyHistogram();
+        LatencyHistogram(const LatencyHistogram& other);
+        LatencyHistogram& operator=(const LatencyHistogram& other);
+
+        void record(std::uint64_t ns);
+        void reset();
+        std::uint64_t count() const;
+        std::uint64_t max() const;
+        double mean() const;
+        std::uint64_t percentile(double p) const;
+    };
+
+    class Stats {
+        std::array<LatencyHistogram, stage_count>          m_stages;
+        std::array<std::atomic<std::uint64_t>, counter_count> m_counters;
+
+    public:
+        Stats();
+        Stats(const Stats& other);
+        Stats& operator=(const Stats& other);
+
+        LatencyHistogram& stage(Stage s);
+        const LatencyHistogram& stage(Stage s) const;
+        void add(Counter c, std::uint64_t n);
+        std::uint64_t counter(Counter c) const;
+        void reset();
+
+        friend std::ostream& operator<<(std::ostream& os, const Stats& s);
+    };
+
+    using StageTimes = std::array<std::uint64_t, stage_count>;
+
+    namespace detail {
+        extern thread_local StageTimes* stage_times;
+    }
+
+    // Collects the time this thread spends in each stage while it lives,
+    // so a single request can be broken down.
+    class StageProfile {
+        StageTimes  m_times;
+        StageTimes* m_outer;
+
+    public:
+        StageProfile() : m_times(), m_outer(detail::stage_times) { detail::stage_times = &m_times; }
+        ~StageProfile() { detail::stage_times = m_outer; }
+        StageProfile(const StageProfile&) = delete;
+        StageProfile& operator=(const StageProfile&) = delete;
+
+        const StageTimes& times() const { return m_times; }
+    };
+
+    // Times a stage from construction to destruction, and records it as a
+    // trace span when tracing is on. Building with MICROHAL_NO_STATS
+    // compiles the timers and counters out, leaving only the spans.
+    class StageTimer {
+#ifndef MICROHAL_NO_STATS
+        LatencyHistogram& m_histogram;
+        Stage             m_stage;
+        std::uint64_t     m_start;
+#else
+        TraceSpan         m_span;
+#endif
+    public:
+#ifndef MICROHAL_NO_STATS
+        StageTimer(Stats& stats, Stage s)
+        : m_histogram(stats.stage(s)), m_stage(s), m_start(trace_clock()) {}
+        ~StageTimer() {
+            auto end = trace_clock();
+            m_histogram.record(end - m_start);
+            if (detail::stage_times != nullptr) { (*detail::stage_times)[static_cast<std::size_t>(m_stage)] += end - m_start; }
+            if (tracing()) { trace_span(stage_name(m_stage), m_start, end); }
+        }
+#else
+        StageTimer(Stats&, Stage s) : m_span(stage_name(s)) {}
+#endif
+        StageTimer(const StageTimer&) = delete;
+        StageTimer& operator=(const StageTimer&) = delete;
+    };
+
+    struct SlowRequest {
+        std::time_t   time;
+        std::string   input;
+        std::string   keyword;
+        std::size_t   candidates;
+        std::size_t   reply_length;
+        std::uint64_t total_ns;
+        StageTimes    stages;
+    };
+
+    // Bounded log of the latest requests that took at least threshold
+    // nanoseconds (0 disables it). Checking a request against the threshold
+    // is one relaxed load, so the log can stay on.
+    class SlowLog {
+        std::atomic<std::uint64_t> m_threshold;
+        std::size_t                m_capacity;
+        std::deque<SlowRequest>    m_requests;
+        mutable std::mutex         m_mutex;
+
+    public:
+        explicit SlowLog(std::uint64_t threshold_ns = 100000000, std::size_t capacity = 64);
+        SlowLog(const SlowLog& other);
+        SlowLog& operator=(const SlowLog& other);
+
+        void set_threshold(std::uint64_t ns);
+        std::uint64_t threshold() const;
+        void set_capacity(std::size_t capacity);
+        bool slow(std::uint64_t ns) const;
+        void record(SlowRequest request);
+        std::vector<SlowRequest> requests() const;
+        void clear();
+
+        friend std::ostream& operator<<(std::ostream& os, const SlowLog& log);
+    };
+
+    inline void count(Stats& stats, Counter c, std::uint64_t n) {
+#ifndef MICROHAL_NO_STATS
+        stats.add(c, n);
+#else
+        (void)stats; (void)c; (void)n;
+#endif
+    }
+
+    // Records ns for a stage that is not timed as a scope of its own, such
+    // as first_token, the time from a request's start to its first output.
+    inline void record(Stats& stats, Stage s, std::uint64_t ns) {
+#ifndef MICROHAL_NO_STATS
+        stats.stage(s).record(ns);
+        if (detail::stage_times != nullptr) { (*detail::stage_times)[static_cast<std::size_t>(s)] += ns; }
+#else
+        (void)stats; (void)s; (void)ns;
+#endif
+    }
+}
+
+#endif
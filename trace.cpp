@@ -0,0 +1,119 @@
+#include <algorithm>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "trace.hpp"
+
+namespace microhal {
+    namespace detail {
+        std::atomic<bool> tracing_enabled(false);
+    }
+
+    namespace {
+        // A slot is written by its thread while write_trace may be reading
+        // it, so its fields are relaxed atomics. The writer bumps m_begin
+        // before touching a slot and m_head after, and the reader drops any
+        // slot that m_begin shows may have been reused during the read.
+        struct Event {
+            std::atomic<const char*>   name;
+            std::atomic<std::uint64_t> start;
+            std::atomic<std::uint64_t> end;
+        };
+
+        struct Buffer {
+            std::size_t                tid;
+            std::atomic<std::uint64_t> begin{0};
+            std::atomic<std::uint64_t> head{0};
+            // spans before this were cleared
+            std::atomic<std::uint64_t> tail{0};
+            std::unique_ptr<Event[]>   events{new Event[trace_capacity]};
+        };
+
+        std::mutex registry_mutex;
+        std::vector<std::shared_ptr<Buffer>> registry;
+
+        // Buffers are shared with the registry so spans survive their thread.
+        Buffer& local_buffer() {
+            thread_local std::shared_ptr<Buffer> buffer;
+            if (!buffer) {
+                auto b = std::make_shared<Buffer>();
+                std::lock_guard<std::mutex> lock(registry_mutex);
+                b->tid = registry.size() + 1;
+                registry.push_back(b);
+                buffer = b;
+            }
+            return *buffer;
+        }
+
+        std::vector<std::shared_ptr<Buffer>> buffers() {
+            std::lock_guard<std::mutex> lock(registry_mutex);
+            return registry;
+        }
+    }
+
+    void set_tracing(bool on) {
+        detail::tracing_enabled.store(on, std::memory_order_relaxed);
+    }
+
+    void trace_span(const char* name, std::uint64_t start_ns, std::uint64_t end_ns) {
+        auto& b = local_buffer();
+        auto h = b.head.load(std::memory_order_relaxed);
+        b.begin.store(h + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        auto& e = b.events[h % trace_capacity];
+        e.name.store(name, std::memory_order_relaxed);
+        e.start.store(start_ns, std::memory_order_relaxed);
+        e.end.store(end_ns, std::memory_order_relaxed);
+        b.head.store(h + 1, std::memory_order_release);
+    }
+
+    std::size_t write_trace(std::ostream& os) {
+        struct Span {
+            const char*   name;
+            std::uint64_t start;
+            std::uint64_t end;
+        };
+
+        std::size_t written = 0;
+        os << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+        auto flags = os.flags();
+        os << std::fixed << std::setprecision(3);
+        for (auto& b : buffers()) {
+            auto head = b->head.load(std::memory_order_acquire);
+            auto first = std::max(b->tail.load(std::memory_order_relaxed), head > trace_capacity ? head - trace_capacity : 0);
+            std::vector<Span> spans;
+            spans.reserve(static_cast<std::size_t>(head - first));
+            for (auto i = first; i < head; ++i) {
+                auto& e = b->events[i % trace_capacity];
+                spans.push_back(Span{
+                    e.name.load(std::memory_order_relaxed),
+                    e.start.load(std::memory_order_relaxed),
+                    e.end.load(std::memory_order_relaxed)
+                });
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            auto begin = b->begin.load(std::memory_order_relaxed);
+            auto valid = begin > trace_capacity ? begin - trace_capacity : 0;
+
+            for (auto i = first; i < head; ++i) {
+                if (i < valid) { continue; }
+                auto& s = spans[static_cast<std::size_t>(i - first)];
+                os << (written++ == 0 ? "\n" : ",\n")
+                   << "{\"name\":\"" << s.name << "\",\"cat\":\"microhal\",\"ph\":\"X\",\"pid\":1,\"tid\":" << b->tid
+                   << ",\"ts\":" << static_cast<double>(s.start) / 1e3
+                   << ",\"dur\":" << static_cast<double>(s.end - s.start) / 1e3 << "}";
+            }
+        }
+        os.flags(flags);
+        os << "\n]}\n";
+        return written;
+    }
+
+    void clear_trace() {
+        for (auto& b : buffers()) {
+            b->tail.store(b->head.load(std::memory_order_acquire), std::memory_order_relaxed);
+        }
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef MICROHAL_TRACE_H
+#define MICROHAL_TRACE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+
+namespace microhal {
+
+    // Spans are recorded into a ring buffer per thread, holding the latest
+    // trace_capacity spans of that thread. Recording takes no locks; only a
+    // thread's first span registers its buffer. When tracing is off a span
+    // costs one relaxed load.
+    const std::size_t trace_capacity = 1 << 16;
+
+    void set_tracing(bool on);
+    void trace_span(const char* name, std::uint64_t start_ns, std::uint64_t end_ns);
+
+    // Writes the recorded spans as Chrome trace-event JSON, which Perfetto
+    // and chrome://tracing open directly, and returns the number written.
+    std::size_t write_trace(std::ostream& os);
+    void clear_trace();
+
+    namespace detail {
+        extern std::atomic<bool> tracing_enabled;
+    }
+
+    inline bool tracing() {
+        return detail::tracing_enabled.load(std::memory_order_relaxed);
+    }
+
+    inline std::uint64_t trace_clock() {
+        auto t = std::chrono::steady_clock::now().time_since_epoch();
+        return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(t).count());
+    }
+
+    // Records a span from construction to destruction. name must outlive
+    // the trace, which string literals do.
+    class TraceSpan {
+        const char*   m_name;
+        std::uint64_t m_start;
+
+    public:
+        explicit TraceSpan(const char* name) : m_name(name), m_start(tracing() ? trace_clock() : 0) {}
+        ~TraceSpan() {
+            if (m_start != 0) { trace_span(m_name, m_start, trace_clock()); }
+        }
+        TraceSpan(const TraceSpan&) = delete;
+        TraceSpan& operator=(const TraceSpan&) = delete;
+    };
+}
+
+#endif